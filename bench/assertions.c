@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Cost of passing assertions. TEST_INT_EQ_INLINE reproduces the previous
+ * expansion of TEST_INT_EQ, with the failure path expanded at the call
+ * site, to compare against the out-of-line failure helpers. */
+
+#include <stdio.h>
+
+#include "../src/utest.h"
+
+#define BENCH_NB_VALUES 4096
+
+#define TEST_INT_EQ_INLINE(value_, expected_)             \
+    do {                                                  \
+        int64_t value__ = value_;                         \
+        int64_t expected__ = expected_;                   \
+        const char *value_str_ = #value_;                 \
+                                                          \
+        if (value__ != expected__) {                      \
+            TEST_ABORT("%s is equal to %"PRIi64" "        \
+                       "but should be equal to %"PRIi64,  \
+                       value_str_, value__, expected__);  \
+        }                                                 \
+    } while(0)
+
+static int bench_values[BENCH_NB_VALUES];
+static int bench_expected[BENCH_NB_VALUES];
+
+TEST(empty_loop) {
+    volatile int sink;
+
+    for (size_t i = 0; i < BENCH_NB_VALUES; i++)
+        sink = bench_values[i] + bench_expected[i];
+    (void)sink;
+}
+
+TEST(inline_failure_path) {
+    for (size_t i = 0; i < BENCH_NB_VALUES; i++) {
+        TEST_INT_EQ_INLINE(bench_values[i], bench_expected[i]);
+        TEST_INT_EQ_INLINE(bench_values[i] + 1, bench_expected[i] + 1);
+        TEST_INT_EQ_INLINE(bench_values[i] * 2, bench_expected[i] * 2);
+        TEST_INT_EQ_INLINE(bench_values[i] - 3, bench_expected[i] - 3);
+    }
+}
+
+TEST(cold_failure_path) {
+    for (size_t i = 0; i < BENCH_NB_VALUES; i++) {
+        TEST_INT_EQ(bench_values[i], bench_expected[i]);
+        TEST_INT_EQ(bench_values[i] + 1, bench_expected[i] + 1);
+        TEST_INT_EQ(bench_values[i] * 2, bench_expected[i] * 2);
+        TEST_INT_EQ(bench_values[i] - 3, bench_expected[i] - 3);
+    }
+}
+
+TEST(typed) {
+    for (size_t i = 0; i < BENCH_NB_VALUES; i++) {
+        TEST_EQ(bench_values[i], bench_expected[i]);
+        TEST_EQ(bench_values[i] + 1, bench_expected[i] + 1);
+        TEST_EQ(bench_values[i] * 2, bench_expected[i] * 2);
+        TEST_EQ(bench_values[i] - 3, bench_expected[i] - 3);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    for (size_t i = 0; i < BENCH_NB_VALUES; i++) {
+        bench_values[i] = rand();
+        bench_expected[i] = bench_values[i];
+    }
+
+    suite = test_suite_new("assertions");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    /* Each iteration runs 4 * 4096 assertions */
+    TEST_BENCHMARK_RUN(suite, empty_loop);
+    TEST_BENCHMARK_RUN(suite, inline_failure_path);
+    TEST_BENCHMARK_RUN(suite, cold_failure_path);
+    TEST_BENCHMARK_RUN(suite, typed);
+
+    test_suite_print_results_and_exit(suite);
+}
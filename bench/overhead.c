@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Cost of the framework itself: running empty tests, failing them and
+ * reporting them. Allocations are counted by replacing the allocator of
+ * the C library, which also sees the allocations of stdio. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/utest.h"
+
+#define BENCH_DEFAULT_NB_TESTS 1000000
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+static size_t bench_nb_allocations;
+static size_t bench_nb_allocated_bytes;
+
+void *
+malloc(size_t sz) {
+    bench_nb_allocations++;
+    bench_nb_allocated_bytes += sz;
+    return __libc_malloc(sz);
+}
+
+void *
+calloc(size_t nb, size_t sz) {
+    bench_nb_allocations++;
+    bench_nb_allocated_bytes += nb * sz;
+    return __libc_calloc(nb, sz);
+}
+
+void *
+realloc(void *ptr, size_t sz) {
+    bench_nb_allocations++;
+    bench_nb_allocated_bytes += sz;
+    return __libc_realloc(ptr, sz);
+}
+
+void
+free(void *ptr) {
+    __libc_free(ptr);
+}
+
+TEST(passing) {
+}
+
+TEST(failing) {
+    TEST_TRUE(false);
+}
+
+static uint64_t
+bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+bench_run(const char *reporter_name, const char *test_name,
+          test_function function, size_t nb_tests) {
+    struct test_suite *suite;
+    struct test_reporter reporter;
+    size_t nb_allocations, nb_allocated_bytes;
+    uint64_t start, duration;
+    FILE *output;
+
+    output = fopen("/dev/null", "w");
+    if (!output) {
+        perror("cannot open /dev/null");
+        exit(1);
+    }
+
+    suite = test_suite_new("overhead");
+    test_suite_add_output(suite, output);
+
+    if (strcmp(reporter_name, "terminal") == 0) {
+        reporter = test_reporter_terminal(output);
+    } else if (strcmp(reporter_name, "json") == 0) {
+        reporter = test_reporter_json(output);
+    } else if (strcmp(reporter_name, "bin") == 0) {
+        reporter = test_reporter_bin(output);
+    } else {
+        /* Records are built but go nowhere */
+        memset(&reporter, 0, sizeof(struct test_reporter));
+    }
+
+    test_suite_add_reporter(suite, &reporter);
+    test_suite_start(suite);
+
+    nb_allocations = bench_nb_allocations;
+    nb_allocated_bytes = bench_nb_allocated_bytes;
+    start = bench_now();
+
+    for (size_t i = 0; i < nb_tests; i++)
+        test_suite_run_test(suite, test_name, function);
+
+    duration = bench_now() - start;
+    nb_allocations = bench_nb_allocations - nb_allocations;
+    nb_allocated_bytes = bench_nb_allocated_bytes - nb_allocated_bytes;
+
+    test_suite_print_results(suite);
+    test_suite_delete(suite);
+
+    printf("%-10s %-10s %10.1f %14.2f %14.1f\n",
+           reporter_name, test_name,
+           (double)duration / (double)nb_tests,
+           (double)nb_allocations / (double)nb_tests,
+           (double)nb_allocated_bytes / (double)nb_tests);
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+    static const char *reporters[] = {"none", "terminal", "json", "bin"};
+
+    size_t nb_tests;
+
+    nb_tests = BENCH_DEFAULT_NB_TESTS;
+    if (argc > 1)
+        nb_tests = strtoul(argv[1], NULL, 10);
+
+    printf("%-10s %-10s %10s %14s %14s\n",
+           "reporter", "test", "ns/test", "allocs/test", "bytes/test");
+
+    for (size_t i = 0; i < sizeof(reporters) / sizeof(reporters[0]); i++) {
+        bench_run(reporters[i], "passing", TEST_FUNCTION_NAME(passing),
+                  nb_tests);
+        bench_run(reporters[i], "failing", TEST_FUNCTION_NAME(failing),
+                  nb_tests);
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+
+#include "internal.h"
+
+void
+test_fail_true(struct test_context *ctx, const char *file, int line,
+               const char *expr) {
+    test_abort(ctx, file, line, "%s is not true", expr);
+}
+
+void
+test_fail_false(struct test_context *ctx, const char *file, int line,
+                const char *expr) {
+    test_abort(ctx, file, line, "%s is not false", expr);
+}
+
+void
+test_fail_int_eq(struct test_context *ctx, const char *file, int line,
+                 const char *expr, intmax_t value, intmax_t expected) {
+    test_abort(ctx, file, line,
+               "%s is equal to %"PRIdMAX" but should be equal to %"PRIdMAX,
+               expr, value, expected);
+}
+
+void
+test_fail_uint_eq(struct test_context *ctx, const char *file, int line,
+                  const char *expr, uintmax_t value, uintmax_t expected) {
+    test_abort(ctx, file, line,
+               "%s is equal to %"PRIuMAX" but should be equal to %"PRIuMAX,
+               expr, value, expected);
+}
+
+void
+test_fail_float_eq(struct test_context *ctx, const char *file, int line,
+                   const char *expr, float value, float expected) {
+    test_abort(ctx, file, line,
+               "%s is equal to %.9g but should be equal to %.9g",
+               expr, (double)value, (double)expected);
+}
+
+void
+test_fail_double_eq(struct test_context *ctx, const char *file, int line,
+                    const char *expr, double value, double expected) {
+    test_abort(ctx, file, line,
+               "%s is equal to %.17g but should be equal to %.17g",
+               expr, value, expected);
+}
+
+void
+test_fail_ldouble_eq(struct test_context *ctx, const char *file, int line,
+                     const char *expr, long double value,
+                     long double expected) {
+    test_abort(ctx, file, line,
+               "%s is equal to %.21Lg but should be equal to %.21Lg",
+               expr, value, expected);
+}
+
+void
+test_fail_bool_eq(struct test_context *ctx, const char *file, int line,
+                  const char *expr, bool value, bool expected) {
+    test_abort(ctx, file, line, "%s is %s but should be %s",
+               expr, (value ? "true" : "false"),
+               (expected ? "true" : "false"));
+}
+
+static bool
+test_is_multiline(const char *string) {
+    const char *eol;
+
+    /* A single line followed by a newline is displayed fine on one line */
+    eol = strchr(string, '\n');
+    return eol && eol[1] != '\0';
+}
+
+void
+test_fail_string_eq(struct test_context *ctx, const char *file, int line,
+                    const char *expr, const char *value,
+                    const char *expected) {
+    if (value && expected
+     && (test_is_multiline(value) || test_is_multiline(expected))) {
+        size_t nb_added, nb_removed, len;
+        char *diff, *errmsg;
+
+        diff = test_diff_lines(expected, value, &nb_added, &nb_removed);
+
+        len = strlen(expr) + strlen(diff) + 128;
+        errmsg = test_malloc(len);
+        snprintf(errmsg, len,
+                 "%s is not equal to the expected string "
+                 "(%zu %s added, %zu %s removed):\n--- expected\n+++ value%s",
+                 expr, nb_added, (nb_added == 1) ? "line" : "lines",
+                 nb_removed, (nb_removed == 1) ? "line" : "lines", diff);
+        free(diff);
+
+        test_abort_message(ctx, file, line, errmsg);
+    } else if (value && expected) {
+        test_abort(ctx, file, line,
+                   "%s is the string \"%s\" but should be the string \"%s\"",
+                   expr, value, expected);
+    } else if (expected) {
+        test_abort(ctx, file, line,
+                   "%s is null but should be the string \"%s\"",
+                   expr, expected);
+    } else {
+        test_abort(ctx, file, line,
+                   "%s is the string \"%s\" but should be null",
+                   expr, value);
+    }
+}
+
+void
+test_fail_mem_eq(struct test_context *ctx, const char *file, int line,
+                 const char *expr, const void *value, size_t value_sz,
+                 const void *expected, size_t expected_sz) {
+    char errmsg[TEST_ERROR_BUFSZ];
+    char *value_str, *expected_str;
+
+    if (value && expected && value_sz != expected_sz) {
+        test_abort(ctx, file, line,
+                   "%s is %zu bytes long but should be %zu bytes long",
+                   expr, value_sz, expected_sz);
+    }
+
+    value_str = value ? test_format_data(value, value_sz) : NULL;
+    expected_str = expected ? test_format_data(expected, expected_sz) : NULL;
+
+    if (value && expected) {
+        snprintf(errmsg, sizeof(errmsg),
+                 "%s contains \"%s\" but should contain \"%s\"",
+                 expr, value_str, expected_str);
+    } else if (expected) {
+        snprintf(errmsg, sizeof(errmsg),
+                 "%s is null but should be the string \"%s\"",
+                 expr, expected_str);
+    } else {
+        snprintf(errmsg, sizeof(errmsg),
+                 "%s is the string \"%s\" but should be null",
+                 expr, value_str);
+    }
+
+    free(value_str);
+    free(expected_str);
+
+    test_abort(ctx, file, line, "%s", errmsg);
+}
+
+void
+test_fail_ptr_eq(struct test_context *ctx, const char *file, int line,
+                 const char *expr, const void *value, const void *expected) {
+    if (value && expected) {
+        test_abort(ctx, file, line,
+                   "%s is equal to %p but should be equal to %p",
+                   expr, value, expected);
+    } else if (expected) {
+        test_abort(ctx, file, line,
+                   "%s is null but should be equal to %p", expr, expected);
+    } else {
+        test_abort(ctx, file, line,
+                   "%s is equal to %p but should be null", expr, value);
+    }
+}
+
+void
+test_fail_ptr_null(struct test_context *ctx, const char *file, int line,
+                   const char *expr) {
+    test_abort(ctx, file, line, "%s is not null", expr);
+}
+
+void
+test_fail_ptr_not_null(struct test_context *ctx, const char *file, int line,
+                       const char *expr) {
+    test_abort(ctx, file, line, "%s is null", expr);
+}
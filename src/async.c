@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Async tests run as coroutines on their own stack. Waiting for a file
+ * descriptor or a deadline switches back to the scheduler, which resumes
+ * the test when epoll reports the descriptor as ready or when the deadline
+ * expires. Since the jump buffer of each test lives on its stack,
+ * test_abort() works as in synchronous tests. */
+
+#define TEST_ASYNC_STACK_SZ (256 * 1024)
+
+enum test_async_state {
+    TEST_ASYNC_RUNNING,
+    TEST_ASYNC_WAITING,
+    TEST_ASYNC_DONE,
+};
+
+struct test_async {
+    const struct test *test;
+    struct test_scheduler *scheduler;
+
+    ucontext_t context;
+    void *stack;         /* including the guard page */
+    size_t stack_sz;
+
+    enum test_async_state state;
+    int fd;              /* watched copy of the descriptor waited for,
+                            -1 if only waiting for the deadline */
+    uint32_t ready_events;
+    uint64_t deadline;   /* 0 if none */
+
+    uint64_t start;
+    struct test_context ctx;
+    struct test_record record;
+
+    /* Output captured while the test was running */
+    char *output;
+    size_t output_len;
+};
+
+struct test_scheduler {
+    struct test_suite *suite;
+    int epoll_fd;
+    ucontext_t context;
+
+    struct test_async **running;
+    size_t nb_running;
+};
+
+static _Thread_local struct test_async *test_async_starting;
+
+static void test_async_start(struct test_scheduler *, const struct test *);
+static void test_async_resume(struct test_async *);
+static void test_async_finish(struct test_async *);
+static void test_async_main(void);
+static void test_async_yield(struct test_async *);
+static uint64_t test_async_deadline(int);
+static int test_scheduler_timeout(const struct test_scheduler *);
+static void test_async_add_output(struct test_async *, const char *);
+
+int
+test_suite_run_async(struct test_suite *suite) {
+    struct test_scheduler scheduler;
+    struct epoll_event events[64];
+    size_t next_test, limit;
+    int ret;
+
+    memset(&scheduler, 0, sizeof(struct test_scheduler));
+    scheduler.suite = suite;
+
+    scheduler.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (scheduler.epoll_fd == -1) {
+        fprintf(stderr, "cannot create epoll instance: %s\n",
+                strerror(errno));
+        abort();
+    }
+
+    limit = (suite->async_limit > 0) ? suite->async_limit : 1;
+    scheduler.running = test_malloc(limit * sizeof(struct test_async *));
+
+    test_suite_plan_tests(suite, suite->nb_async_tests);
+
+    ret = 0;
+    next_test = 0;
+
+    while (next_test < suite->nb_async_tests || scheduler.nb_running > 0) {
+        int nb_events, timeout;
+        uint64_t now;
+
+        /* Start new tests; each one runs until it waits or finishes */
+        while (next_test < suite->nb_async_tests
+            && scheduler.nb_running < limit) {
+            test_async_start(&scheduler, suite->async_tests + next_test++);
+        }
+
+        /* Collect tests which are done */
+        for (size_t i = 0; i < scheduler.nb_running;) {
+            struct test_async *async;
+
+            async = scheduler.running[i];
+            if (async->state != TEST_ASYNC_DONE) {
+                i++;
+                continue;
+            }
+
+            if (async->record.status != TEST_STATUS_PASSED)
+                ret = -1;
+
+            test_async_finish(async);
+            scheduler.running[i] = scheduler.running[--scheduler.nb_running];
+        }
+
+        if (scheduler.nb_running == 0)
+            continue;
+
+        timeout = test_scheduler_timeout(&scheduler);
+
+        nb_events = epoll_wait(scheduler.epoll_fd, events, 64, timeout);
+        if (nb_events == -1) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "cannot wait for events: %s\n", strerror(errno));
+            abort();
+        }
+
+        for (int i = 0; i < nb_events; i++) {
+            struct test_async *async;
+
+            async = events[i].data.ptr;
+
+            async->ready_events = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                async->ready_events |= TEST_READABLE;
+            if (events[i].events & (EPOLLOUT | EPOLLERR))
+                async->ready_events |= TEST_WRITABLE;
+
+            test_async_resume(async);
+        }
+
+        now = test_now();
+
+        for (size_t i = 0; i < scheduler.nb_running; i++) {
+            struct test_async *async;
+
+            async = scheduler.running[i];
+            if (async->state == TEST_ASYNC_WAITING
+             && async->deadline > 0 && async->deadline <= now) {
+                async->ready_events = 0;
+                test_async_resume(async);
+            }
+        }
+    }
+
+    free(scheduler.running);
+    close(scheduler.epoll_fd);
+
+    return ret;
+}
+
+uint32_t
+test_wait_fd(struct test_context *ctx, const char *file, int line,
+             int fd, uint32_t events, int timeout) {
+    struct test_async *async;
+    struct epoll_event event;
+    int watch_fd;
+
+    async = ctx->async;
+
+    if (!async) {
+        struct pollfd pfd;
+        uint32_t ready_events;
+        int ret;
+
+        /* Synchronous tests simply block */
+        pfd.fd = fd;
+        pfd.events = 0;
+        if (events & TEST_READABLE)
+            pfd.events |= POLLIN;
+        if (events & TEST_WRITABLE)
+            pfd.events |= POLLOUT;
+
+        do {
+            ret = poll(&pfd, 1, timeout);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1) {
+            test_abort(ctx, file, line, "cannot poll fd %d: %s",
+                       fd, strerror(errno));
+        }
+
+        ready_events = 0;
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+            ready_events |= TEST_READABLE;
+        if (pfd.revents & (POLLOUT | POLLERR))
+            ready_events |= TEST_WRITABLE;
+
+        return ready_events;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.ptr = async;
+    if (events & TEST_READABLE)
+        event.events |= EPOLLIN;
+    if (events & TEST_WRITABLE)
+        event.events |= EPOLLOUT;
+
+    /* Epoll only accepts one registration per descriptor, and several
+     * tests may wait for the same one: each waiter watches its own copy */
+    watch_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (watch_fd == -1) {
+        test_abort(ctx, file, line, "cannot duplicate fd %d: %s",
+                   fd, strerror(errno));
+    }
+
+    if (epoll_ctl(async->scheduler->epoll_fd, EPOLL_CTL_ADD,
+                  watch_fd, &event) == -1) {
+        int err;
+
+        err = errno;
+        close(watch_fd);
+        test_abort(ctx, file, line, "cannot watch fd %d: %s",
+                   fd, strerror(err));
+    }
+
+    async->fd = watch_fd;
+    async->deadline = test_async_deadline(timeout);
+
+    test_async_yield(async);
+
+    epoll_ctl(async->scheduler->epoll_fd, EPOLL_CTL_DEL, watch_fd, NULL);
+    close(watch_fd);
+    async->fd = -1;
+
+    return async->ready_events;
+}
+
+void
+test_sleep(struct test_context *ctx, unsigned int ms) {
+    struct test_async *async;
+
+    async = ctx->async;
+
+    if (!async) {
+        struct timespec ts;
+
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000;
+
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            continue;
+
+        return;
+    }
+
+    async->fd = -1;
+    async->deadline = test_now() + (uint64_t)ms * 1000000;
+
+    test_async_yield(async);
+}
+
+static void
+test_async_start(struct test_scheduler *scheduler, const struct test *test) {
+    struct test_suite *suite;
+    struct test_async *async;
+    size_t page_sz;
+
+    suite = scheduler->suite;
+
+    async = test_malloc(sizeof(struct test_async));
+    memset(async, 0, sizeof(struct test_async));
+
+    async->test = test;
+    async->scheduler = scheduler;
+    async->fd = -1;
+
+    /* A guard page turns stack overflows into crashes */
+    page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    async->stack_sz = TEST_ASYNC_STACK_SZ + page_sz;
+
+    async->stack = mmap(NULL, async->stack_sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (async->stack == MAP_FAILED) {
+        fprintf(stderr, "cannot allocate stack: %s\n", strerror(errno));
+        abort();
+    }
+
+    mprotect(async->stack, page_sz, PROT_NONE);
+
+    if (getcontext(&async->context) == -1) {
+        fprintf(stderr, "cannot get context: %s\n", strerror(errno));
+        abort();
+    }
+
+    async->context.uc_stack.ss_sp = (char *)async->stack + page_sz;
+    async->context.uc_stack.ss_size = TEST_ASYNC_STACK_SZ;
+    async->context.uc_link = &scheduler->context;
+    makecontext(&async->context, test_async_main, 0);
+
+    scheduler->running[scheduler->nb_running++] = async;
+
+    suite->nb_tests++;
+    test_suite_begin_test(suite, test->name);
+
+    async->start = test_now();
+
+    /* makecontext() only passes int arguments */
+    test_async_starting = async;
+    test_async_resume(async);
+}
+
+static void
+test_async_resume(struct test_async *async) {
+    struct test_suite *suite;
+
+    suite = async->scheduler->suite;
+
+    async->state = TEST_ASYNC_RUNNING;
+    async->deadline = 0;
+
+    /* Tests share the standard output; what is written while a test runs
+     * belongs to it */
+    if (suite->capture)
+        test_capture_start(suite->capture);
+    if (suite->catch_signals)
+        test_crash_enter(&async->ctx);
+
+    if (swapcontext(&async->scheduler->context, &async->context) == -1) {
+        fprintf(stderr, "cannot switch context: %s\n", strerror(errno));
+        abort();
+    }
+
+    if (suite->catch_signals)
+        test_crash_leave();
+    if (suite->capture)
+        test_async_add_output(async, test_capture_stop(suite->capture));
+}
+
+static void
+test_async_finish(struct test_async *async) {
+    struct test_suite *suite;
+
+    suite = async->scheduler->suite;
+
+    if (async->record.status == TEST_STATUS_PASSED) {
+        suite->nb_passed_tests++;
+    } else {
+        suite->nb_failed_tests++;
+        async->record.output = async->output;
+    }
+
+    test_suite_report(suite, &async->record);
+    free(async->ctx.message);
+    free(async->output);
+
+    munmap(async->stack, async->stack_sz);
+    free(async);
+}
+
+static void
+test_async_main(void) {
+    struct test_async *async;
+    struct test_suite *suite;
+    struct test_context *ctx;
+    struct test_record *record;
+
+    async = test_async_starting;
+    suite = async->scheduler->suite;
+
+    ctx = &async->ctx;
+    ctx->test_name = async->test->name;
+    ctx->test_suite = suite;
+    ctx->async = async;
+
+    record = &async->record;
+    record->test_name = async->test->name;
+
+    if (sigsetjmp(ctx->before, suite->catch_signals) != 0) {
+        /* Test function aborted */
+        record->duration = test_now() - async->start;
+        record->status = TEST_STATUS_FAILED;
+
+        if (ctx->signo != 0) {
+            test_crash_format(ctx);
+            record->crash = &ctx->crash;
+        }
+
+        record->file = ctx->file;
+        record->line = ctx->line;
+        record->message = test_context_message(ctx);
+
+        async->state = TEST_ASYNC_DONE;
+        return;
+    }
+
+    async->test->function(suite, ctx);
+
+    record->duration = test_now() - async->start;
+    record->status = TEST_STATUS_PASSED;
+
+    /* Returning switches to uc_link, i.e. the scheduler */
+    async->state = TEST_ASYNC_DONE;
+}
+
+static void
+test_async_yield(struct test_async *async) {
+    async->state = TEST_ASYNC_WAITING;
+
+    if (swapcontext(&async->context, &async->scheduler->context) == -1) {
+        fprintf(stderr, "cannot switch context: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+static uint64_t
+test_async_deadline(int timeout) {
+    if (timeout < 0)
+        return 0;
+
+    return test_now() + (uint64_t)timeout * 1000000;
+}
+
+static int
+test_scheduler_timeout(const struct test_scheduler *scheduler) {
+    uint64_t now, deadline;
+
+    deadline = 0;
+    for (size_t i = 0; i < scheduler->nb_running; i++) {
+        const struct test_async *async;
+
+        async = scheduler->running[i];
+        if (async->deadline > 0
+         && (deadline == 0 || async->deadline < deadline)) {
+            deadline = async->deadline;
+        }
+    }
+
+    if (deadline == 0)
+        return -1;
+
+    now = test_now();
+    if (deadline <= now)
+        return 0;
+
+    /* Round up so that the deadline has expired when we wake up */
+    return (int)((deadline - now + 999999) / 1000000);
+}
+
+static void
+test_async_add_output(struct test_async *async, const char *output) {
+    size_t len, limit;
+
+    if (!output)
+        return;
+
+    /* The capture limit applies to the whole test */
+    limit = async->scheduler->suite->capture_limit;
+    if (async->output_len >= limit)
+        return;
+
+    len = strlen(output);
+    if (len > limit - async->output_len)
+        len = limit - async->output_len;
+
+    async->output = test_realloc(async->output, async->output_len + len + 1);
+    memcpy(async->output + async->output_len, output, len);
+    async->output_len += len;
+    async->output[async->output_len] = '\0';
+}
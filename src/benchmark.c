@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Each sample runs the benchmark function for at least this long, unless
+ * caches are flushed between samples, in which case each sample is a
+ * single cold iteration. */
+#define TEST_BENCHMARK_MIN_SAMPLE_DURATION 1000000 /* nanoseconds */
+
+/* Used when the size of the last level cache cannot be read */
+#define TEST_BENCHMARK_DEFAULT_LLC_SIZE (32 * 1024 * 1024)
+
+/* Keeps the compiler from removing cache flushing loops */
+static volatile unsigned char test_benchmark_sink;
+
+struct test_benchmark_run {
+    test_function function;
+    double *samples;
+    size_t nb_samples;
+    size_t nb_iterations;
+};
+
+/* test_suite_execute() only passes the suite and the context to the
+ * function it runs */
+static _Thread_local struct test_benchmark_run *test_benchmark_running;
+
+static void test_benchmark_main(struct test_suite *, struct test_context *);
+static size_t test_benchmark_calibrate(struct test_suite *,
+                                       struct test_context *, test_function);
+static void test_benchmark_flush_caches(struct test_suite *);
+static size_t test_benchmark_llc_size(void);
+static unsigned int test_benchmark_system_noise(int);
+static bool test_benchmark_read_sysfs(const char *, char *, size_t);
+
+void
+test_suite_set_benchmark_cpu(struct test_suite *suite, int cpu) {
+    suite->benchmark_cpu = cpu;
+}
+
+bool
+test_benchmark_is_valid_cpu(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE;
+}
+
+void
+test_suite_set_benchmark_samples(struct test_suite *suite, size_t nb) {
+    suite->benchmark_nb_samples = (nb > 1) ? nb : 2;
+}
+
+void
+test_suite_set_benchmark_warmup(struct test_suite *suite, uint64_t ms) {
+    suite->benchmark_warmup = ms;
+}
+
+void
+test_suite_set_benchmark_flush_caches(struct test_suite *suite, bool flush) {
+    suite->benchmark_flush_caches = flush;
+}
+
+void
+test_suite_set_benchmark_noise_threshold(struct test_suite *suite,
+                                         double threshold) {
+    suite->benchmark_noise_threshold = threshold;
+}
+
+int
+test_suite_run_benchmark(struct test_suite *suite, const char *test_name,
+                         test_function function) {
+    struct test_context ctx;
+    struct test_record record;
+    struct test_benchmark benchmark;
+    struct test_benchmark_run run;
+    cpu_set_t old_cpus, cpus;
+    bool pinned;
+    double *samples, sum, sum_sq;
+    size_t nb_samples;
+    int ret;
+
+    suite->nb_tests++;
+
+    test_suite_begin_test(suite, test_name);
+
+    memset(&benchmark, 0, sizeof(struct test_benchmark));
+    benchmark.cpu = -1;
+
+    nb_samples = suite->benchmark_nb_samples;
+    samples = test_malloc(nb_samples * sizeof(double));
+
+    /* Pinning */
+    pinned = false;
+    if (suite->benchmark_cpu >= 0) {
+        if (!test_benchmark_is_valid_cpu(suite->benchmark_cpu)) {
+            fprintf(stderr, "cannot pin benchmark to cpu %d: invalid cpu\n",
+                    suite->benchmark_cpu);
+            abort();
+        }
+
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &old_cpus) == -1) {
+            fprintf(stderr, "cannot read cpu affinity: %s\n",
+                    strerror(errno));
+            abort();
+        }
+
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t)suite->benchmark_cpu, &cpus);
+
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == -1) {
+            fprintf(stderr, "cannot pin benchmark to cpu %d: %s\n",
+                    suite->benchmark_cpu, strerror(errno));
+            abort();
+        }
+
+        pinned = true;
+        benchmark.cpu = suite->benchmark_cpu;
+    } else {
+        benchmark.cpu = sched_getcpu();
+    }
+
+    memset(&run, 0, sizeof(struct test_benchmark_run));
+    run.function = function;
+    run.samples = samples;
+    run.nb_samples = nb_samples;
+
+    test_benchmark_running = &run;
+    ret = test_suite_execute(suite, &ctx, test_name, test_benchmark_main,
+                             &record, false);
+    test_benchmark_running = NULL;
+
+    if (pinned)
+        sched_setaffinity(0, sizeof(cpu_set_t), &old_cpus);
+
+    if (ret == -1) {
+        free(samples);
+
+        suite->nb_failed_tests++;
+        test_suite_report(suite, &record);
+        free(ctx.message);
+        return -1;
+    }
+
+    /* Statistics */
+    benchmark.nb_samples = nb_samples;
+    benchmark.nb_iterations = run.nb_iterations;
+
+    sum = 0.0;
+    benchmark.min = samples[0];
+    for (size_t i = 0; i < nb_samples; i++) {
+        sum += samples[i];
+        if (samples[i] < benchmark.min)
+            benchmark.min = samples[i];
+    }
+    benchmark.mean = sum / (double)nb_samples;
+
+    sum_sq = 0.0;
+    for (size_t i = 0; i < nb_samples; i++) {
+        double delta;
+
+        delta = samples[i] - benchmark.mean;
+        sum_sq += delta * delta;
+    }
+    benchmark.stddev = sqrt(sum_sq / (double)(nb_samples - 1));
+
+    if (benchmark.mean > 0.0)
+        benchmark.cv = benchmark.stddev / benchmark.mean;
+
+    free(samples);
+
+    /* Noise */
+    if (benchmark.cv > suite->benchmark_noise_threshold)
+        benchmark.noise |= TEST_NOISE_VARIATION;
+    if (benchmark.cpu >= 0)
+        benchmark.noise |= test_benchmark_system_noise(benchmark.cpu);
+
+    record.benchmark = &benchmark;
+
+    suite->nb_passed_tests++;
+    test_suite_report(suite, &record);
+    return 0;
+}
+
+const char *
+test_noise_string(unsigned int noise) {
+    static const char *strings[] = {
+        "",
+        "high variation",
+        "frequency scaling",
+        "high variation, frequency scaling",
+        "smt",
+        "high variation, smt",
+        "frequency scaling, smt",
+        "high variation, frequency scaling, smt",
+    };
+
+    return strings[noise & 0x07];
+}
+
+static void
+test_benchmark_main(struct test_suite *suite, struct test_context *ctx) {
+    struct test_benchmark_run *run;
+    uint64_t warmup_end;
+
+    run = test_benchmark_running;
+
+    /* Let the cpu reach its highest frequency before measuring */
+    warmup_end = test_now() + suite->benchmark_warmup * 1000000;
+    do {
+        run->function(suite, ctx);
+    } while (test_now() < warmup_end);
+
+    if (suite->benchmark_flush_caches) {
+        run->nb_iterations = 1;
+    } else {
+        run->nb_iterations = test_benchmark_calibrate(suite, ctx,
+                                                      run->function);
+    }
+
+    for (size_t i = 0; i < run->nb_samples; i++) {
+        uint64_t sample_start;
+
+        if (suite->benchmark_flush_caches)
+            test_benchmark_flush_caches(suite);
+
+        sample_start = test_now();
+        for (size_t j = 0; j < run->nb_iterations; j++)
+            run->function(suite, ctx);
+
+        run->samples[i] = (double)(test_now() - sample_start)
+                        / (double)run->nb_iterations;
+    }
+}
+
+static size_t
+test_benchmark_calibrate(struct test_suite *suite, struct test_context *ctx,
+                         test_function function) {
+    size_t nb_iterations;
+
+    /* Double the number of iterations until a sample is long enough for
+     * the clock resolution and call overhead to be negligible */
+    nb_iterations = 1;
+    for (;;) {
+        uint64_t start, duration;
+
+        start = test_now();
+        for (size_t i = 0; i < nb_iterations; i++)
+            function(suite, ctx);
+        duration = test_now() - start;
+
+        if (duration >= TEST_BENCHMARK_MIN_SAMPLE_DURATION)
+            break;
+        if (nb_iterations >= SIZE_MAX / 2)
+            break;
+
+        nb_iterations *= 2;
+    }
+
+    return nb_iterations;
+}
+
+static void
+test_benchmark_flush_caches(struct test_suite *suite) {
+    unsigned char *buffer, sum;
+    size_t size;
+
+    if (!suite->benchmark_flush_buffer) {
+        /* Twice the size of the last level cache, to evict it whatever the
+         * replacement policy */
+        suite->benchmark_flush_buffer_sz = test_benchmark_llc_size() * 2;
+        suite->benchmark_flush_buffer =
+            test_malloc(suite->benchmark_flush_buffer_sz);
+        memset(suite->benchmark_flush_buffer, 0,
+               suite->benchmark_flush_buffer_sz);
+    }
+
+    buffer = suite->benchmark_flush_buffer;
+    size = suite->benchmark_flush_buffer_sz;
+
+    sum = 0;
+    for (size_t i = 0; i < size; i += 64) {
+        buffer[i]++;
+        sum ^= buffer[i];
+    }
+
+    test_benchmark_sink = sum;
+}
+
+static size_t
+test_benchmark_llc_size(void) {
+    char value[64];
+    long size;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return (size_t)size;
+#endif
+
+    if (test_benchmark_read_sysfs("/sys/devices/system/cpu/cpu0"
+                                  "/cache/index3/size",
+                                  value, sizeof(value))) {
+        char *end;
+
+        size = strtol(value, &end, 10);
+        if (*end == 'K') {
+            size *= 1024;
+        } else if (*end == 'M') {
+            size *= 1024 * 1024;
+        }
+
+        if (size > 0)
+            return (size_t)size;
+    }
+
+    return TEST_BENCHMARK_DEFAULT_LLC_SIZE;
+}
+
+static unsigned int
+test_benchmark_system_noise(int cpu) {
+    char path[128], value[64];
+    unsigned int noise;
+
+    noise = 0;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+    if (test_benchmark_read_sysfs(path, value, sizeof(value))) {
+        if (strcmp(value, "performance") != 0)
+            noise |= TEST_NOISE_FREQUENCY_SCALING;
+    }
+
+    if (test_benchmark_read_sysfs("/sys/devices/system/cpu/smt/active",
+                                  value, sizeof(value))) {
+        if (strcmp(value, "1") == 0)
+            noise |= TEST_NOISE_SMT;
+    } else {
+        /* Older kernels only expose the topology */
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d"
+                 "/topology/thread_siblings_list", cpu);
+        if (test_benchmark_read_sysfs(path, value, sizeof(value))) {
+            if (strpbrk(value, ",-"))
+                noise |= TEST_NOISE_SMT;
+        }
+    }
+
+    return noise;
+}
+
+static bool
+test_benchmark_read_sysfs(const char *path, char *value, size_t sz) {
+    FILE *file;
+    size_t len;
+
+    file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    if (!fgets(value, (int)sz, file)) {
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+
+    len = strlen(value);
+    while (len > 0 && (value[len - 1] == '\n' || value[len - 1] == ' '))
+        value[--len] = '\0';
+
+    return true;
+}
@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* File layout:
+ *
+ *   header          magic, version, byte order
+ *   records         struct test_bin_record[nb_records]
+ *   index           uint32_t[nb_records], record indexes sorted by name
+ *   strings         NUL-terminated strings, padded to 8 bytes
+ *   footer          section offsets and suite results
+ *
+ * Every section is 8-byte aligned so that a mapped file can be used
+ * directly. Integers use the byte order of the writer. */
+
+#define TEST_BIN_MAGIC         "UTESTBIN"
+#define TEST_BIN_FOOTER_MAGIC  "UTESTEND"
+#define TEST_BIN_VERSION       1
+#define TEST_BIN_BYTE_ORDER    0x01020304
+
+struct test_bin_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+};
+
+struct test_bin_footer {
+    uint64_t records_offset;
+    uint64_t nb_records;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+
+    uint64_t nb_tests;
+    uint64_t nb_passed_tests;
+    uint64_t nb_failed_tests;
+    uint64_t duration;
+
+    uint32_t suite_name;
+    uint32_t padding;
+
+    char magic[8];
+};
+
+struct test_bin_writer {
+    FILE *output;
+
+    uint32_t suite_name;
+
+    struct test_bin_record *records;
+    size_t nb_records;
+    size_t records_sz;
+
+    char *strings;
+    size_t strings_len;
+    size_t strings_sz;
+
+    /* Open addressing table of string offsets, 0 marks an empty slot */
+    uint32_t *table;
+    size_t table_sz;
+    size_t table_count;
+};
+
+struct test_bin {
+    const char *data;
+    size_t size;
+
+    const struct test_bin_footer *footer;
+    const struct test_bin_record *records;
+    const uint32_t *index;
+    const char *strings;
+};
+
+struct test_bin_sort_entry {
+    const char *name;
+    uint32_t idx;
+};
+
+static void test_bin_begin_suite(void *, const char *);
+static void test_bin_end_suite(void *, const struct test_results *);
+static void test_bin_end_test(void *, const struct test_record *, size_t);
+static void test_bin_free_data(void *);
+
+static uint32_t test_bin_intern(struct test_bin_writer *, const char *);
+static void test_bin_write(struct test_bin_writer *, const void *, size_t);
+static void test_bin_pad(struct test_bin_writer *, size_t);
+static int test_bin_sort_entry_cmp(const void *, const void *);
+static uint64_t test_bin_hash(const char *, size_t);
+static bool test_bin_validate(struct test_bin *);
+
+struct test_reporter
+test_reporter_bin(FILE *output) {
+    struct test_bin_writer *writer;
+    struct test_reporter reporter;
+
+    writer = test_malloc(sizeof(struct test_bin_writer));
+    memset(writer, 0, sizeof(struct test_bin_writer));
+
+    writer->output = output;
+
+    /* The empty string is always at offset 0 */
+    writer->strings_sz = 4096;
+    writer->strings = test_malloc(writer->strings_sz);
+    writer->strings[0] = '\0';
+    writer->strings_len = 1;
+
+    writer->table_sz = 1024;
+    writer->table = test_malloc(writer->table_sz * sizeof(uint32_t));
+    memset(writer->table, 0, writer->table_sz * sizeof(uint32_t));
+
+    memset(&reporter, 0, sizeof(struct test_reporter));
+
+    reporter.begin_suite = test_bin_begin_suite;
+    reporter.end_suite = test_bin_end_suite;
+    reporter.end_test = test_bin_end_test;
+    reporter.free_data = test_bin_free_data;
+    reporter.data = writer;
+
+    return reporter;
+}
+
+static void
+test_bin_begin_suite(void *data, const char *suite_name) {
+    struct test_bin_writer *writer;
+
+    writer = data;
+    writer->suite_name = test_bin_intern(writer, suite_name);
+}
+
+static void
+test_bin_end_test(void *data, const struct test_record *records,
+                  size_t nb_records) {
+    struct test_bin_writer *writer;
+
+    writer = data;
+
+    if (writer->nb_records + nb_records > writer->records_sz) {
+        size_t nsz;
+
+        nsz = writer->records_sz ? writer->records_sz * 2 : 256;
+        while (nsz < writer->nb_records + nb_records)
+            nsz *= 2;
+
+        writer->records = test_realloc(writer->records,
+                                       nsz * sizeof(struct test_bin_record));
+        writer->records_sz = nsz;
+    }
+
+    for (size_t i = 0; i < nb_records; i++) {
+        const struct test_record *record;
+        struct test_bin_record *brecord;
+
+        record = records + i;
+        brecord = writer->records + writer->nb_records++;
+
+        memset(brecord, 0, sizeof(struct test_bin_record));
+
+        brecord->test_name = test_bin_intern(writer, record->test_name);
+        brecord->status = (uint32_t)record->status;
+        brecord->duration = record->duration;
+
+        if (record->status != TEST_STATUS_PASSED) {
+            brecord->file = test_bin_intern(writer, record->file);
+            brecord->line = record->line;
+            brecord->message = test_bin_intern(writer, record->message);
+        }
+    }
+}
+
+static void
+test_bin_end_suite(void *data, const struct test_results *results) {
+    struct test_bin_writer *writer;
+    struct test_bin_header header;
+    struct test_bin_footer footer;
+    struct test_bin_sort_entry *entries;
+    uint32_t *index;
+    size_t offset;
+
+    writer = data;
+
+    /* Name index */
+    entries = test_malloc((writer->nb_records + 1)
+                          * sizeof(struct test_bin_sort_entry));
+    index = test_malloc((writer->nb_records + 1) * sizeof(uint32_t));
+
+    for (size_t i = 0; i < writer->nb_records; i++) {
+        entries[i].name = writer->strings + writer->records[i].test_name;
+        entries[i].idx = (uint32_t)i;
+    }
+
+    qsort(entries, writer->nb_records, sizeof(struct test_bin_sort_entry),
+          test_bin_sort_entry_cmp);
+
+    for (size_t i = 0; i < writer->nb_records; i++)
+        index[i] = entries[i].idx;
+
+    free(entries);
+
+    /* Sections */
+    memset(&header, 0, sizeof(struct test_bin_header));
+    memcpy(header.magic, TEST_BIN_MAGIC, sizeof(header.magic));
+    header.version = TEST_BIN_VERSION;
+    header.byte_order = TEST_BIN_BYTE_ORDER;
+
+    memset(&footer, 0, sizeof(struct test_bin_footer));
+
+    offset = 0;
+    test_bin_write(writer, &header, sizeof(struct test_bin_header));
+    offset += sizeof(struct test_bin_header);
+
+    footer.records_offset = offset;
+    footer.nb_records = writer->nb_records;
+    test_bin_write(writer, writer->records,
+                   writer->nb_records * sizeof(struct test_bin_record));
+    offset += writer->nb_records * sizeof(struct test_bin_record);
+
+    footer.index_offset = offset;
+    test_bin_write(writer, index, writer->nb_records * sizeof(uint32_t));
+    offset += writer->nb_records * sizeof(uint32_t);
+    test_bin_pad(writer, offset);
+    offset = (offset + 7) & ~(size_t)7;
+
+    footer.strings_offset = offset;
+    footer.strings_size = writer->strings_len;
+    test_bin_write(writer, writer->strings, writer->strings_len);
+    offset += writer->strings_len;
+    test_bin_pad(writer, offset);
+
+    footer.nb_tests = results->nb_tests;
+    footer.nb_passed_tests = results->nb_passed_tests;
+    footer.nb_failed_tests = results->nb_failed_tests;
+    footer.duration = results->duration;
+    footer.suite_name = writer->suite_name;
+    memcpy(footer.magic, TEST_BIN_FOOTER_MAGIC, sizeof(footer.magic));
+
+    test_bin_write(writer, &footer, sizeof(struct test_bin_footer));
+    fflush(writer->output);
+
+    free(index);
+}
+
+static void
+test_bin_free_data(void *data) {
+    struct test_bin_writer *writer;
+
+    writer = data;
+
+    free(writer->records);
+    free(writer->strings);
+    free(writer->table);
+    free(writer);
+}
+
+struct test_bin *
+test_bin_open(const char *path) {
+    struct test_bin *bin;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct test_bin_header)
+                           + sizeof(struct test_bin_footer)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    bin = test_malloc(sizeof(struct test_bin));
+    memset(bin, 0, sizeof(struct test_bin));
+
+    bin->data = data;
+    bin->size = (size_t)st.st_size;
+
+    if (!test_bin_validate(bin)) {
+        test_bin_close(bin);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return bin;
+}
+
+void
+test_bin_close(struct test_bin *bin) {
+    if (!bin)
+        return;
+
+    munmap((void *)bin->data, bin->size);
+
+    memset(bin, 0, sizeof(struct test_bin));
+    free(bin);
+}
+
+const char *
+test_bin_suite_name(const struct test_bin *bin) {
+    return test_bin_string(bin, bin->footer->suite_name);
+}
+
+void
+test_bin_results(const struct test_bin *bin, struct test_results *results) {
+    memset(results, 0, sizeof(struct test_results));
+
+    results->nb_tests = (size_t)bin->footer->nb_tests;
+    results->nb_passed_tests = (size_t)bin->footer->nb_passed_tests;
+    results->nb_failed_tests = (size_t)bin->footer->nb_failed_tests;
+    results->duration = bin->footer->duration;
+}
+
+size_t
+test_bin_nb_records(const struct test_bin *bin) {
+    return (size_t)bin->footer->nb_records;
+}
+
+const struct test_bin_record *
+test_bin_record(const struct test_bin *bin, size_t idx) {
+    return bin->records + idx;
+}
+
+const struct test_bin_record *
+test_bin_sorted_record(const struct test_bin *bin, size_t idx) {
+    return bin->records + bin->index[idx];
+}
+
+const struct test_bin_record *
+test_bin_find(const struct test_bin *bin, const char *name) {
+    size_t low, high;
+
+    low = 0;
+    high = (size_t)bin->footer->nb_records;
+
+    while (low < high) {
+        const struct test_bin_record *record;
+        size_t mid;
+        int cmp;
+
+        mid = low + (high - low) / 2;
+        record = test_bin_sorted_record(bin, mid);
+
+        cmp = strcmp(name, test_bin_string(bin, record->test_name));
+        if (cmp == 0) {
+            return record;
+        } else if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+const char *
+test_bin_string(const struct test_bin *bin, uint32_t offset) {
+    if (offset >= bin->footer->strings_size)
+        return "";
+
+    return bin->strings + offset;
+}
+
+static uint32_t
+test_bin_intern(struct test_bin_writer *writer, const char *string) {
+    uint32_t offset;
+    size_t len, slot;
+
+    if (!string || *string == '\0')
+        return 0;
+
+    len = strlen(string);
+
+    slot = test_bin_hash(string, len) & (writer->table_sz - 1);
+    while ((offset = writer->table[slot]) != 0) {
+        if (strcmp(writer->strings + offset, string) == 0)
+            return offset;
+
+        slot = (slot + 1) & (writer->table_sz - 1);
+    }
+
+    /* New string */
+    if (writer->strings_len + len + 1 > writer->strings_sz) {
+        size_t nsz;
+
+        nsz = writer->strings_sz * 2;
+        while (nsz < writer->strings_len + len + 1)
+            nsz *= 2;
+
+        writer->strings = test_realloc(writer->strings, nsz);
+        writer->strings_sz = nsz;
+    }
+
+    offset = (uint32_t)writer->strings_len;
+    memcpy(writer->strings + offset, string, len + 1);
+    writer->strings_len += len + 1;
+
+    writer->table[slot] = offset;
+    writer->table_count++;
+
+    /* Keep the load factor under 0.5 */
+    if (writer->table_count * 2 > writer->table_sz) {
+        uint32_t *table;
+        size_t table_sz;
+
+        table_sz = writer->table_sz * 2;
+        table = test_malloc(table_sz * sizeof(uint32_t));
+        memset(table, 0, table_sz * sizeof(uint32_t));
+
+        for (size_t i = 0; i < writer->table_sz; i++) {
+            const char *str;
+            uint32_t soffset;
+
+            soffset = writer->table[i];
+            if (soffset == 0)
+                continue;
+
+            str = writer->strings + soffset;
+
+            slot = test_bin_hash(str, strlen(str)) & (table_sz - 1);
+            while (table[slot] != 0)
+                slot = (slot + 1) & (table_sz - 1);
+
+            table[slot] = soffset;
+        }
+
+        free(writer->table);
+        writer->table = table;
+        writer->table_sz = table_sz;
+    }
+
+    return offset;
+}
+
+static void
+test_bin_write(struct test_bin_writer *writer, const void *data, size_t sz) {
+    if (sz == 0)
+        return;
+
+    if (fwrite(data, 1, sz, writer->output) != sz) {
+        fprintf(stderr, "cannot write binary results: %s\n",
+                strerror(errno));
+        abort();
+    }
+}
+
+static void
+test_bin_pad(struct test_bin_writer *writer, size_t offset) {
+    static const char zeros[8];
+
+    if (offset % 8 != 0)
+        test_bin_write(writer, zeros, 8 - offset % 8);
+}
+
+static int
+test_bin_sort_entry_cmp(const void *p1, const void *p2) {
+    const struct test_bin_sort_entry *e1, *e2;
+    int cmp;
+
+    e1 = p1;
+    e2 = p2;
+
+    cmp = strcmp(e1->name, e2->name);
+    if (cmp != 0)
+        return cmp;
+
+    /* Keep records with the same name in execution order */
+    return (e1->idx > e2->idx) - (e1->idx < e2->idx);
+}
+
+static uint64_t
+test_bin_hash(const char *string, size_t len) {
+    uint64_t hash;
+
+    /* FNV-1a */
+    hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool
+test_bin_validate(struct test_bin *bin) {
+    const struct test_bin_header *header;
+    const struct test_bin_footer *footer;
+    uint64_t records_size, index_size, records_end, index_end;
+    size_t footer_offset;
+
+    header = (const struct test_bin_header *)bin->data;
+    if (memcmp(header->magic, TEST_BIN_MAGIC, sizeof(header->magic)) != 0)
+        return false;
+    if (header->version != TEST_BIN_VERSION)
+        return false;
+    if (header->byte_order != TEST_BIN_BYTE_ORDER)
+        return false;
+
+    if (bin->size % 8 != 0)
+        return false;
+
+    footer_offset = bin->size - sizeof(struct test_bin_footer);
+    footer = (const struct test_bin_footer *)(bin->data + footer_offset);
+    if (memcmp(footer->magic, TEST_BIN_FOOTER_MAGIC,
+               sizeof(footer->magic)) != 0) {
+        return false;
+    }
+
+    /* Sections must be aligned, ordered and inside the file. Each offset
+     * is checked before sizes are added to it so that sums cannot wrap. */
+    if (footer->nb_records > UINT32_MAX)
+        return false;
+
+    records_size = footer->nb_records * sizeof(struct test_bin_record);
+    index_size = footer->nb_records * sizeof(uint32_t);
+
+    if (footer->records_offset % 8 != 0 || footer->index_offset % 4 != 0
+     || footer->strings_offset % 8 != 0) {
+        return false;
+    }
+
+    if (footer->records_offset < sizeof(struct test_bin_header)
+     || footer->records_offset > footer_offset
+     || records_size > footer_offset - footer->records_offset) {
+        return false;
+    }
+
+    records_end = footer->records_offset + records_size;
+
+    if (footer->index_offset < records_end
+     || footer->index_offset > footer_offset
+     || index_size > footer_offset - footer->index_offset) {
+        return false;
+    }
+
+    index_end = footer->index_offset + index_size;
+
+    if (footer->strings_offset < index_end
+     || footer->strings_offset > footer_offset
+     || footer->strings_size > footer_offset - footer->strings_offset) {
+        return false;
+    }
+
+    bin->footer = footer;
+    bin->records = (const struct test_bin_record *)
+        (bin->data + footer->records_offset);
+    bin->index = (const uint32_t *)(bin->data + footer->index_offset);
+    bin->strings = bin->data + footer->strings_offset;
+
+    if (footer->strings_size == 0
+     || bin->strings[footer->strings_size - 1] != '\0') {
+        return false;
+    }
+
+    for (size_t i = 0; i < footer->nb_records; i++) {
+        const struct test_bin_record *record;
+
+        if (bin->index[i] >= footer->nb_records)
+            return false;
+
+        record = bin->records + i;
+        if (record->test_name >= footer->strings_size
+         || record->file >= footer->strings_size
+         || record->message >= footer->strings_size) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* The output of each test goes through its own pipe. A reader thread, kept
+ * for the whole suite, drains the pipe while the test runs so that a test
+ * writing more than the capacity of the pipe does not block; it keeps at
+ * most limit bytes and counts the rest.
+ *
+ * Once the test is over and the output restored, the reader is woken up
+ * through a second pipe. It stops at end of file, or after reading what is
+ * left in the pipe if a copy of the write end is still open, e.g. in a
+ * child process of the test. */
+
+/* How much the reader reads at most once woken up, a few times the
+ * capacity of a pipe */
+#define TEST_CAPTURE_DRAIN_SZ (256 * 1024)
+
+struct test_capture {
+    size_t limit;
+
+    int saved_stdout;
+    int saved_stderr;
+
+    int wake_fds[2];
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    int fd;      /* read end of the pipe of the current test, or -1 */
+    bool done;
+    bool stop;
+
+    char *data;
+    size_t len;
+    size_t nb_dropped;
+};
+
+static void *test_capture_main(void *);
+static void test_capture_read(struct test_capture *, int);
+static int test_capture_dup(int);
+
+struct test_capture *
+test_capture_new(size_t limit) {
+    struct test_capture *capture;
+    int err;
+
+    capture = test_malloc(sizeof(struct test_capture));
+    memset(capture, 0, sizeof(struct test_capture));
+
+    capture->limit = limit;
+    capture->fd = -1;
+    capture->done = true;
+
+    /* One byte for the final \0 and room for the truncation notice */
+    capture->data = test_malloc(limit + 64);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    capture->saved_stdout = test_capture_dup(STDOUT_FILENO);
+    capture->saved_stderr = test_capture_dup(STDERR_FILENO);
+
+    if (pipe(capture->wake_fds) == -1) {
+        fprintf(stderr, "cannot create pipe: %s\n", strerror(errno));
+        abort();
+    }
+
+    fcntl(capture->wake_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(capture->wake_fds[1], F_SETFD, FD_CLOEXEC);
+
+    pthread_mutex_init(&capture->mutex, NULL);
+    pthread_cond_init(&capture->cond, NULL);
+
+    err = pthread_create(&capture->thread, NULL, test_capture_main, capture);
+    if (err != 0) {
+        fprintf(stderr, "cannot create thread: %s\n", strerror(err));
+        abort();
+    }
+
+    return capture;
+}
+
+void
+test_capture_delete(struct test_capture *capture) {
+    if (!capture)
+        return;
+
+    pthread_mutex_lock(&capture->mutex);
+    capture->stop = true;
+    pthread_cond_broadcast(&capture->cond);
+    pthread_mutex_unlock(&capture->mutex);
+
+    pthread_join(capture->thread, NULL);
+
+    pthread_cond_destroy(&capture->cond);
+    pthread_mutex_destroy(&capture->mutex);
+
+    close(capture->saved_stdout);
+    close(capture->saved_stderr);
+
+    close(capture->wake_fds[0]);
+    close(capture->wake_fds[1]);
+
+    free(capture->data);
+
+    memset(capture, 0, sizeof(struct test_capture));
+    free(capture);
+}
+
+void
+test_capture_start(struct test_capture *capture) {
+    int fds[2];
+
+    fflush(stdout);
+    fflush(stderr);
+
+    if (pipe(fds) == -1) {
+        fprintf(stderr, "cannot create pipe: %s\n", strerror(errno));
+        abort();
+    }
+
+    if (dup2(fds[1], STDOUT_FILENO) == -1
+     || dup2(fds[1], STDERR_FILENO) == -1) {
+        fprintf(stderr, "cannot redirect output: %s\n", strerror(errno));
+        abort();
+    }
+
+    close(fds[1]);
+
+    pthread_mutex_lock(&capture->mutex);
+    capture->fd = fds[0];
+    capture->done = false;
+    capture->len = 0;
+    capture->nb_dropped = 0;
+    pthread_cond_broadcast(&capture->cond);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+const char *
+test_capture_stop(struct test_capture *capture) {
+    char byte;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /* Restoring both descriptors closes the last write end of the pipe
+     * unless the test leaked a copy, e.g. to a child process which is still
+     * running */
+    dup2(capture->saved_stdout, STDOUT_FILENO);
+    dup2(capture->saved_stderr, STDERR_FILENO);
+
+    byte = 0;
+    while (write(capture->wake_fds[1], &byte, 1) == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "cannot write to pipe: %s\n", strerror(errno));
+            abort();
+        }
+    }
+
+    pthread_mutex_lock(&capture->mutex);
+    while (!capture->done)
+        pthread_cond_wait(&capture->cond, &capture->mutex);
+    pthread_mutex_unlock(&capture->mutex);
+
+    if (capture->nb_dropped > 0) {
+        snprintf(capture->data + capture->len, 64,
+                 "\n[%zu bytes dropped]", capture->nb_dropped);
+        capture->len += strlen(capture->data + capture->len);
+    }
+
+    capture->data[capture->len] = '\0';
+
+    return (capture->len > 0) ? capture->data : NULL;
+}
+
+static void *
+test_capture_main(void *arg) {
+    struct test_capture *capture;
+
+    capture = arg;
+
+    pthread_mutex_lock(&capture->mutex);
+
+    for (;;) {
+        int fd;
+
+        while (capture->fd == -1 && !capture->stop)
+            pthread_cond_wait(&capture->cond, &capture->mutex);
+
+        if (capture->fd == -1)
+            break;
+
+        fd = capture->fd;
+        pthread_mutex_unlock(&capture->mutex);
+
+        test_capture_read(capture, fd);
+        close(fd);
+
+        pthread_mutex_lock(&capture->mutex);
+        capture->fd = -1;
+        capture->done = true;
+        pthread_cond_broadcast(&capture->cond);
+    }
+
+    pthread_mutex_unlock(&capture->mutex);
+    return NULL;
+}
+
+static void
+test_capture_read(struct test_capture *capture, int fd) {
+    struct pollfd pfds[2];
+    char buf[4096];
+    size_t nb_drained;
+    bool draining;
+
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = capture->wake_fds[0];
+    pfds[1].events = POLLIN;
+
+    draining = false;
+    nb_drained = 0;
+
+    for (;;) {
+        ssize_t ret;
+        size_t nb_bytes, room;
+
+        if (!draining) {
+            if (poll(pfds, 2, -1) == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                fprintf(stderr, "cannot poll pipe: %s\n", strerror(errno));
+                abort();
+            }
+
+            if (pfds[1].revents & POLLIN) {
+                char byte;
+
+                if (read(pfds[1].fd, &byte, 1) == 1) {
+                    /* The test is over: read what is left without waiting
+                     * for writers which may never go away */
+                    draining = true;
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    continue;
+                }
+            }
+
+            /* At end of file, wait for the end of the test */
+            if (pfds[0].fd == -1 || !(pfds[0].revents & (POLLIN | POLLHUP)))
+                continue;
+        } else if (pfds[0].fd == -1 || nb_drained >= TEST_CAPTURE_DRAIN_SZ) {
+            break;
+        }
+
+        ret = read(fd, buf, sizeof(buf));
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (draining)
+                break;
+
+            pfds[0].fd = -1;
+            continue;
+        } else if (ret == 0) {
+            pfds[0].fd = -1;
+            continue;
+        }
+
+        nb_bytes = (size_t)ret;
+        if (draining)
+            nb_drained += nb_bytes;
+
+        room = capture->limit - capture->len;
+        if (nb_bytes > room) {
+            capture->nb_dropped += nb_bytes - room;
+            nb_bytes = room;
+        }
+
+        memcpy(capture->data + capture->len, buf, nb_bytes);
+        capture->len += nb_bytes;
+    }
+}
+
+static int
+test_capture_dup(int fd) {
+    int nfd;
+
+    nfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (nfd == -1) {
+        fprintf(stderr, "cannot duplicate file descriptor %d: %s\n",
+                fd, strerror(errno));
+        abort();
+    }
+
+    return nfd;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Handlers run on an alternate stack so that stack overflows can be
+ * reported; each thread running tests has its own. */
+#define TEST_CRASH_STACK_SZ (64 * 1024)
+
+/* Frames of the signal handler and of the signal trampoline */
+#define TEST_CRASH_SKIPPED_FRAMES 2
+
+static const int test_crash_signals[] = {
+    SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV,
+};
+
+#define TEST_CRASH_NB_SIGNALS \
+    (sizeof(test_crash_signals) / sizeof(test_crash_signals[0]))
+
+static struct sigaction test_crash_old_actions[TEST_CRASH_NB_SIGNALS];
+
+static _Thread_local struct test_context *test_crash_context;
+static _Thread_local void *test_crash_stack;
+
+static void test_crash_handle_signal(int, siginfo_t *, void *);
+static void test_crash_append_frame(char *, size_t, size_t *, void *);
+
+void
+test_crash_install(void) {
+    struct sigaction action;
+    void *frame;
+
+    /* The first call to backtrace() loads the unwinder, which allocates
+     * memory and must not happen in a signal handler */
+    backtrace(&frame, 1);
+
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_sigaction = test_crash_handle_signal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    for (size_t i = 0; i < TEST_CRASH_NB_SIGNALS; i++) {
+        if (sigaction(test_crash_signals[i], &action,
+                      test_crash_old_actions + i) == -1) {
+            fprintf(stderr, "cannot install handler for signal %d: %s\n",
+                    test_crash_signals[i], strerror(errno));
+            abort();
+        }
+    }
+}
+
+void
+test_crash_uninstall(void) {
+    for (size_t i = 0; i < TEST_CRASH_NB_SIGNALS; i++)
+        sigaction(test_crash_signals[i], test_crash_old_actions + i, NULL);
+}
+
+void
+test_crash_enter(struct test_context *ctx) {
+    if (!test_crash_stack) {
+        stack_t stack;
+
+        test_crash_stack = test_malloc(TEST_CRASH_STACK_SZ);
+
+        memset(&stack, 0, sizeof(stack_t));
+        stack.ss_sp = test_crash_stack;
+        stack.ss_size = TEST_CRASH_STACK_SZ;
+
+        if (sigaltstack(&stack, NULL) == -1) {
+            fprintf(stderr, "cannot set alternate signal stack: %s\n",
+                    strerror(errno));
+            abort();
+        }
+    }
+
+    test_crash_context = ctx;
+}
+
+void
+test_crash_leave(void) {
+    test_crash_context = NULL;
+}
+
+void
+test_crash_release_thread(void) {
+    stack_t stack;
+
+    if (!test_crash_stack)
+        return;
+
+    memset(&stack, 0, sizeof(stack_t));
+    stack.ss_flags = SS_DISABLE;
+    sigaltstack(&stack, NULL);
+
+    free(test_crash_stack);
+    test_crash_stack = NULL;
+}
+
+void
+test_crash_format(struct test_context *ctx) {
+    const char *name;
+    size_t len;
+
+    switch (ctx->signo) {
+    case SIGABRT: name = "SIGABRT"; break;
+    case SIGBUS:  name = "SIGBUS";  break;
+    case SIGFPE:  name = "SIGFPE";  break;
+    case SIGILL:  name = "SIGILL";  break;
+    case SIGSEGV: name = "SIGSEGV"; break;
+    default:      name = "signal";  break;
+    }
+
+    if (ctx->signo == SIGABRT) {
+        snprintf(ctx->errmsg, TEST_ERROR_BUFSZ, "killed by %s (%s)",
+                 name, strsignal(ctx->signo));
+    } else {
+        snprintf(ctx->errmsg, TEST_ERROR_BUFSZ,
+                 "killed by %s (%s) at address %p",
+                 name, strsignal(ctx->signo), ctx->fault_address);
+    }
+
+    /* There is no source location: the crash is reported where the test
+     * is defined, the crashing frame being the first of the backtrace */
+    if (!ctx->file) {
+        ctx->file = "?";
+        ctx->line = 0;
+    }
+
+    len = 0;
+    ctx->backtrace[0] = '\0';
+
+    for (int i = TEST_CRASH_SKIPPED_FRAMES; i < ctx->nb_frames; i++) {
+        test_crash_append_frame(ctx->backtrace, sizeof(ctx->backtrace),
+                                &len, ctx->frames[i]);
+    }
+
+    len = strlen(ctx->backtrace);
+    if (len > 0 && ctx->backtrace[len - 1] == '\n')
+        ctx->backtrace[len - 1] = '\0';
+
+    memset(&ctx->crash, 0, sizeof(struct test_crash));
+    ctx->crash.signo = ctx->signo;
+    ctx->crash.address = ctx->fault_address;
+    ctx->crash.backtrace = ctx->backtrace;
+}
+
+static void
+test_crash_handle_signal(int signo, siginfo_t *info, void *uctx) {
+    struct test_context *ctx;
+
+    ctx = test_crash_context;
+
+    if (!ctx) {
+        static const char message[] = "fatal signal outside of a test\n";
+        ssize_t ret;
+
+        /* The crash did not happen in a test, or happened while reporting
+         * a previous crash: there is nothing we can safely return to, and
+         * reporting could deadlock on the stdio or malloc lock held by the
+         * crashing code. The signal is blocked until the handler returns,
+         * so it is delivered again with its default action. */
+        ret = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)ret;
+
+        signal(signo, SIG_DFL);
+        raise(signo);
+        return;
+    }
+
+    test_crash_context = NULL;
+
+    ctx->signo = signo;
+    ctx->fault_address = info->si_addr;
+    ctx->nb_frames = backtrace(ctx->frames, TEST_CRASH_MAX_FRAMES);
+
+    siglongjmp(ctx->before, -1);
+}
+
+static void
+test_crash_append_frame(char *buf, size_t bufsz, size_t *plen,
+                        void *address) {
+    Dl_info info;
+    int ret;
+
+    if (*plen >= bufsz)
+        return;
+
+    memset(&info, 0, sizeof(Dl_info));
+
+    if (dladdr(address, &info) != 0 && info.dli_sname) {
+        ret = snprintf(buf + *plen, bufsz - *plen, "%s+0x%zx\n",
+                       info.dli_sname,
+                       (size_t)((char *)address - (char *)info.dli_saddr));
+    } else if (info.dli_fname) {
+        const char *name;
+
+        name = strrchr(info.dli_fname, '/');
+        name = name ? name + 1 : info.dli_fname;
+
+        ret = snprintf(buf + *plen, bufsz - *plen, "[%s+0x%zx]\n", name,
+                       (size_t)((char *)address - (char *)info.dli_fbase));
+    } else {
+        ret = snprintf(buf + *plen, bufsz - *plen, "[%p]\n", address);
+    }
+
+    if (ret < 0 || (size_t)ret >= bufsz - *plen) {
+        /* Drop the truncated frame and ignore the following ones */
+        buf[*plen] = '\0';
+        *plen = bufsz;
+        return;
+    }
+
+    *plen += (size_t)ret;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+/* Line diff based on "An O(ND) Difference Algorithm and Its Variations"
+ * (Myers, 1986), using the linear space refinement: a point of the
+ * shortest edit script is found by searching from both ends at the same
+ * time until the searches meet, then both halves are diffed recursively.
+ * The result is a pair of arrays marking removed and added lines, as in GNU
+ * diff, from which unified hunks are built. */
+
+#define TEST_DIFF_CONTEXT 3
+
+/* Maximum number of lines of hunks in the output */
+#define TEST_DIFF_MAX_LINES 200
+
+struct test_diff_line {
+    const char *ptr;
+    size_t len; /* including the final '\n' if there is one */
+    uint64_t hash;
+};
+
+struct test_diff {
+    struct test_diff_line *a; /* expected */
+    size_t nb_a;
+    struct test_diff_line *b; /* value */
+    size_t nb_b;
+
+    bool *removed;
+    bool *added;
+
+    /* Furthest reaching paths indexed by diagonal, offset by nb_b + 1 */
+    ptrdiff_t *vf;
+    ptrdiff_t *vb;
+    ptrdiff_t offset;
+};
+
+struct test_diff_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static struct test_diff_line *test_diff_split(const char *, size_t *);
+static bool test_diff_line_equal(const struct test_diff *, ptrdiff_t,
+                                 ptrdiff_t);
+static void test_diff_compare(struct test_diff *, ptrdiff_t, ptrdiff_t,
+                              ptrdiff_t, ptrdiff_t);
+static void test_diff_middle_snake(struct test_diff *, ptrdiff_t, ptrdiff_t,
+                                   ptrdiff_t, ptrdiff_t,
+                                   ptrdiff_t *, ptrdiff_t *);
+static void test_diff_format(const struct test_diff *,
+                             struct test_diff_buffer *);
+static void test_diff_print_line(struct test_diff_buffer *, char,
+                                 const struct test_diff_line *);
+static void test_diff_printf(struct test_diff_buffer *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+
+char *
+test_diff_lines(const char *expected, const char *value,
+                size_t *pnb_added, size_t *pnb_removed) {
+    struct test_diff diff;
+    struct test_diff_buffer buf;
+    size_t nb_diagonals, nb_added, nb_removed;
+
+    memset(&diff, 0, sizeof(struct test_diff));
+
+    diff.a = test_diff_split(expected, &diff.nb_a);
+    diff.b = test_diff_split(value, &diff.nb_b);
+
+    diff.removed = test_malloc(diff.nb_a + 1);
+    memset(diff.removed, 0, diff.nb_a + 1);
+    diff.added = test_malloc(diff.nb_b + 1);
+    memset(diff.added, 0, diff.nb_b + 1);
+
+    /* Diagonals go from -nb_b to nb_a, plus one on each side */
+    nb_diagonals = diff.nb_a + diff.nb_b + 3;
+    diff.offset = (ptrdiff_t)diff.nb_b + 1;
+    diff.vf = test_malloc(nb_diagonals * sizeof(ptrdiff_t));
+    diff.vb = test_malloc(nb_diagonals * sizeof(ptrdiff_t));
+
+    test_diff_compare(&diff, 0, (ptrdiff_t)diff.nb_a, 0, (ptrdiff_t)diff.nb_b);
+
+    nb_removed = 0;
+    for (size_t i = 0; i < diff.nb_a; i++)
+        nb_removed += diff.removed[i];
+
+    nb_added = 0;
+    for (size_t i = 0; i < diff.nb_b; i++)
+        nb_added += diff.added[i];
+
+    memset(&buf, 0, sizeof(struct test_diff_buffer));
+    test_diff_format(&diff, &buf);
+
+    free(diff.vf);
+    free(diff.vb);
+    free(diff.removed);
+    free(diff.added);
+    free(diff.a);
+    free(diff.b);
+
+    *pnb_added = nb_added;
+    *pnb_removed = nb_removed;
+
+    if (!buf.data) {
+        buf.data = test_malloc(1);
+        buf.data[0] = '\0';
+    }
+
+    return buf.data;
+}
+
+static struct test_diff_line *
+test_diff_split(const char *string, size_t *pnb_lines) {
+    struct test_diff_line *lines;
+    size_t nb_lines;
+    const char *ptr;
+
+    nb_lines = 0;
+    for (ptr = string; *ptr != '\0'; nb_lines++) {
+        ptr += strcspn(ptr, "\n");
+        if (*ptr == '\n')
+            ptr++;
+    }
+
+    lines = test_malloc((nb_lines + 1) * sizeof(struct test_diff_line));
+
+    ptr = string;
+    for (size_t i = 0; i < nb_lines; i++) {
+        struct test_diff_line *line;
+        uint64_t hash;
+
+        line = lines + i;
+        line->ptr = ptr;
+        line->len = strcspn(ptr, "\n");
+        if (ptr[line->len] == '\n')
+            line->len++;
+
+        /* FNV-1a */
+        hash = 0xcbf29ce484222325;
+        for (size_t j = 0; j < line->len; j++) {
+            hash ^= (unsigned char)ptr[j];
+            hash *= 0x100000001b3;
+        }
+        line->hash = hash;
+
+        ptr += line->len;
+    }
+
+    *pnb_lines = nb_lines;
+    return lines;
+}
+
+static bool
+test_diff_line_equal(const struct test_diff *diff, ptrdiff_t i, ptrdiff_t j) {
+    const struct test_diff_line *a, *b;
+
+    a = diff->a + i;
+    b = diff->b + j;
+
+    return a->hash == b->hash && a->len == b->len
+        && memcmp(a->ptr, b->ptr, a->len) == 0;
+}
+
+static void
+test_diff_compare(struct test_diff *diff, ptrdiff_t a0, ptrdiff_t a1,
+                  ptrdiff_t b0, ptrdiff_t b1) {
+    ptrdiff_t x, y;
+
+    /* Lines common to both ends are not part of the edit script */
+    while (a0 < a1 && b0 < b1 && test_diff_line_equal(diff, a0, b0)) {
+        a0++;
+        b0++;
+    }
+
+    while (a0 < a1 && b0 < b1 && test_diff_line_equal(diff, a1 - 1, b1 - 1)) {
+        a1--;
+        b1--;
+    }
+
+    if (a0 == a1) {
+        while (b0 < b1)
+            diff->added[b0++] = true;
+    } else if (b0 == b1) {
+        while (a0 < a1)
+            diff->removed[a0++] = true;
+    } else {
+        test_diff_middle_snake(diff, a0, a1, b0, b1, &x, &y);
+
+        test_diff_compare(diff, a0, x, b0, y);
+        test_diff_compare(diff, x, a1, y, b1);
+    }
+}
+
+static void
+test_diff_middle_snake(struct test_diff *diff, ptrdiff_t a0, ptrdiff_t a1,
+                       ptrdiff_t b0, ptrdiff_t b1,
+                       ptrdiff_t *px, ptrdiff_t *py) {
+    ptrdiff_t dmin, dmax, fmid, bmid, fmin, fmax, bmin, bmax;
+    ptrdiff_t *vf, *vb;
+    bool odd;
+
+    /* Diagonal k is the set of points where x - y = k; vf[k] is the
+     * furthest x reached on diagonal k by the forward search and vb[k] the
+     * lowest x reached by the backward search. Diagonals are bounded to the
+     * ones crossing the rectangle being compared. */
+    vf = diff->vf + diff->offset;
+    vb = diff->vb + diff->offset;
+
+    dmin = a0 - b1;
+    dmax = a1 - b0;
+    fmid = a0 - b0;
+    bmid = a1 - b1;
+    odd = ((fmid - bmid) & 1) != 0;
+
+    fmin = fmax = fmid;
+    bmin = bmax = bmid;
+
+    vf[fmid] = a0;
+    vb[bmid] = a1;
+
+    for (;;) {
+        if (fmin > dmin) {
+            vf[--fmin - 1] = -1;
+        } else {
+            fmin++;
+        }
+
+        if (fmax < dmax) {
+            vf[++fmax + 1] = -1;
+        } else {
+            fmax--;
+        }
+
+        for (ptrdiff_t k = fmax; k >= fmin; k -= 2) {
+            ptrdiff_t x, y;
+
+            x = (vf[k - 1] >= vf[k + 1]) ? vf[k - 1] + 1 : vf[k + 1];
+            y = x - k;
+
+            while (x < a1 && y < b1 && test_diff_line_equal(diff, x, y)) {
+                x++;
+                y++;
+            }
+
+            vf[k] = x;
+
+            if (odd && bmin <= k && k <= bmax && vb[k] <= x) {
+                *px = x;
+                *py = y;
+                return;
+            }
+        }
+
+        if (bmin > dmin) {
+            vb[--bmin - 1] = PTRDIFF_MAX;
+        } else {
+            bmin++;
+        }
+
+        if (bmax < dmax) {
+            vb[++bmax + 1] = PTRDIFF_MAX;
+        } else {
+            bmax--;
+        }
+
+        for (ptrdiff_t k = bmax; k >= bmin; k -= 2) {
+            ptrdiff_t x, y;
+
+            x = (vb[k - 1] < vb[k + 1]) ? vb[k - 1] : vb[k + 1] - 1;
+            y = x - k;
+
+            while (x > a0 && y > b0
+                && test_diff_line_equal(diff, x - 1, y - 1)) {
+                x--;
+                y--;
+            }
+
+            vb[k] = x;
+
+            if (!odd && fmin <= k && k <= fmax && x <= vf[k]) {
+                *px = x;
+                *py = y;
+                return;
+            }
+        }
+    }
+}
+
+static void
+test_diff_format(const struct test_diff *diff, struct test_diff_buffer *buf) {
+    size_t i, j, nb_lines;
+
+    i = 0;
+    j = 0;
+    nb_lines = 0;
+
+    while (i < diff->nb_a || j < diff->nb_b) {
+        size_t hi, hj, ei, ej, nb_equal;
+
+        /* Find the next change */
+        while (i < diff->nb_a && j < diff->nb_b
+            && !diff->removed[i] && !diff->added[j]) {
+            i++;
+            j++;
+        }
+
+        if (i == diff->nb_a && j == diff->nb_b)
+            break;
+
+        /* Extend the hunk until TEST_DIFF_CONTEXT lines after the last
+         * change which is followed by too many common lines to be merged
+         * with the next one */
+        hi = (i > TEST_DIFF_CONTEXT) ? i - TEST_DIFF_CONTEXT : 0;
+        hj = j - (i - hi);
+
+        ei = i;
+        ej = j;
+        nb_equal = 0;
+
+        for (;;) {
+            if (ei < diff->nb_a && diff->removed[ei]) {
+                ei++;
+                nb_equal = 0;
+            } else if (ej < diff->nb_b && diff->added[ej]) {
+                ej++;
+                nb_equal = 0;
+            } else if (ei < diff->nb_a && ej < diff->nb_b
+                    && nb_equal < 2 * TEST_DIFF_CONTEXT) {
+                ei++;
+                ej++;
+                nb_equal++;
+            } else {
+                break;
+            }
+        }
+
+        if (nb_equal > TEST_DIFF_CONTEXT) {
+            ei -= nb_equal - TEST_DIFF_CONTEXT;
+            ej -= nb_equal - TEST_DIFF_CONTEXT;
+        }
+
+        /* Line numbers start at 1, and empty ranges point to the line
+         * before them */
+        test_diff_printf(buf, "\n@@ -%zu,%zu +%zu,%zu @@",
+                         (ei > hi) ? hi + 1 : hi, ei - hi,
+                         (ej > hj) ? hj + 1 : hj, ej - hj);
+
+        i = hi;
+        j = hj;
+
+        while (i < ei || j < ej) {
+            if (nb_lines >= TEST_DIFF_MAX_LINES) {
+                test_diff_printf(buf, "\n[diff truncated after %d lines]",
+                                 TEST_DIFF_MAX_LINES);
+                return;
+            }
+
+            if (i < ei && diff->removed[i]) {
+                test_diff_print_line(buf, '-', diff->a + i++);
+            } else if (j < ej && diff->added[j]) {
+                test_diff_print_line(buf, '+', diff->b + j++);
+            } else {
+                test_diff_print_line(buf, ' ', diff->a + i);
+                i++;
+                j++;
+            }
+
+            nb_lines++;
+        }
+    }
+}
+
+static void
+test_diff_print_line(struct test_diff_buffer *buf, char prefix,
+                     const struct test_diff_line *line) {
+    if (line->len > 0 && line->ptr[line->len - 1] == '\n') {
+        test_diff_printf(buf, "\n%c%.*s", prefix, (int)(line->len - 1),
+                         line->ptr);
+    } else {
+        test_diff_printf(buf, "\n%c%.*s\n\\ No newline at end of string",
+                         prefix, (int)line->len, line->ptr);
+    }
+}
+
+static void
+test_diff_printf(struct test_diff_buffer *buf, const char *fmt, ...) {
+    va_list ap;
+    size_t len;
+
+    va_start(ap, fmt);
+    len = (size_t)vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (buf->len + len + 1 > buf->size) {
+        buf->size = (buf->size > 0) ? buf->size * 2 : 1024;
+        if (buf->size < buf->len + len + 1)
+            buf->size = buf->len + len + 1;
+
+        buf->data = test_realloc(buf->data, buf->size);
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+    va_end(ap);
+
+    buf->len += len;
+}
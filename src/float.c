@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+/* Array comparisons run in two passes. The first one only counts elements
+ * out of tolerance, with branch-free loops that compilers can vectorize;
+ * the second one, only run on failure, collects details for the error
+ * message. */
+
+#define TEST_ARRAY_NB_OFFENDERS 5
+
+/* Map the bit pattern of a float to an integer whose order matches the order
+ * of floating point values, so that the distance between two integers is
+ * the distance in units in the last place. */
+static inline int32_t
+test_float_ordered_bits(float value) {
+    int32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits < 0) ? INT32_MIN - bits : bits;
+}
+
+static inline int64_t
+test_double_ordered_bits(double value) {
+    int64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits < 0) ? INT64_MIN - bits : bits;
+}
+
+/* Tolerances must be positive or null, and fit the integer type used to
+ * count units in the last place, converting them otherwise being
+ * undefined. */
+static inline bool
+test_tolerance_is_valid(enum test_tolerance mode, double tolerance,
+                        double ulp_max) {
+    if (!(tolerance >= 0.0))
+        return false;
+
+    return mode != TEST_TOLERANCE_ULP || tolerance < ulp_max;
+}
+
+#define TEST_DEFINE_ARRAY_NEAR(name_, type_, int_, uint_, fabs_, fmt_,     \
+                               ulp_max_)                                    \
+    static inline uint_                                                      \
+    test_##name_##_ulp_distance(type_ value, type_ expected) {               \
+        int_ ov, oe;                                                         \
+                                                                             \
+        ov = test_##name_##_ordered_bits(value);                             \
+        oe = test_##name_##_ordered_bits(expected);                          \
+        return (ov > oe) ? (uint_)ov - (uint_)oe : (uint_)oe - (uint_)ov;    \
+    }                                                                        \
+                                                                             \
+    /* Both passes use these predicates, so that they agree on each          \
+     * element whatever the rounding of the tolerance */                     \
+    static inline bool                                                       \
+    test_##name_##_far_absolute(type_ v, type_ e, type_ tol) {               \
+        return !((v == e) | (fabs_(v - e) <= tol));                          \
+    }                                                                        \
+                                                                             \
+    static inline bool                                                       \
+    test_##name_##_far_relative(type_ v, type_ e, type_ tol) {               \
+        type_ av, ae, max;                                                   \
+                                                                             \
+        av = fabs_(v);                                                       \
+        ae = fabs_(e);                                                       \
+        max = (av > ae) ? av : ae;                                           \
+        return !((v == e) | (fabs_(v - e) <= tol * max));                    \
+    }                                                                        \
+                                                                             \
+    static inline bool                                                       \
+    test_##name_##_far_ulp(type_ v, type_ e, uint_ tol) {                    \
+        return (test_##name_##_ulp_distance(v, e) > tol)                     \
+             | (v != v) | (e != e);                                          \
+    }                                                                        \
+                                                                             \
+    static inline bool                                                       \
+    test_##name_##_far(type_ value, type_ expected,                          \
+                       enum test_tolerance mode, double tolerance) {         \
+        switch (mode) {                                                      \
+        case TEST_TOLERANCE_ABSOLUTE:                                        \
+            return test_##name_##_far_absolute(value, expected,              \
+                                               (type_)tolerance);            \
+        case TEST_TOLERANCE_RELATIVE:                                        \
+            return test_##name_##_far_relative(value, expected,              \
+                                               (type_)tolerance);            \
+        case TEST_TOLERANCE_ULP:                                             \
+            return test_##name_##_far_ulp(value, expected,                   \
+                                          (uint_)tolerance);                 \
+        }                                                                    \
+                                                                             \
+        return true;                                                         \
+    }                                                                        \
+                                                                             \
+    static inline double                                                     \
+    test_##name_##_error(type_ value, type_ expected,                        \
+                         enum test_tolerance mode) {                         \
+        if (value == expected)                                               \
+            return 0.0;                                                      \
+        if (isnan(value) || isnan(expected))                                 \
+            return INFINITY;                                                 \
+                                                                             \
+        switch (mode) {                                                      \
+        case TEST_TOLERANCE_ABSOLUTE:                                        \
+            return (double)fabs_(value - expected);                          \
+                                                                             \
+        case TEST_TOLERANCE_RELATIVE:                                        \
+            return (double)fabs_(value - expected)                           \
+                 / (double)fmax(fabs_(value), fabs_(expected));              \
+                                                                             \
+        case TEST_TOLERANCE_ULP:                                             \
+            return (double)test_##name_##_ulp_distance(value, expected);     \
+        }                                                                    \
+                                                                             \
+        return INFINITY;                                                     \
+    }                                                                        \
+                                                                             \
+    size_t                                                                   \
+    test_##name_##_array_count_far(const type_ *values,                      \
+                                   const type_ *expected, size_t n,          \
+                                   enum test_tolerance mode,                 \
+                                   double tolerance) {                       \
+        size_t count;                                                        \
+                                                                             \
+        /* Invalid tolerances are reported by the failure function */        \
+        if (!test_tolerance_is_valid(mode, tolerance, ulp_max_))             \
+            return 1;                                                        \
+                                                                             \
+        count = 0;                                                           \
+                                                                             \
+        switch (mode) {                                                      \
+        case TEST_TOLERANCE_ABSOLUTE: {                                      \
+            type_ tol;                                                       \
+                                                                             \
+            tol = (type_)tolerance;                                          \
+            for (size_t i = 0; i < n; i++) {                                 \
+                count += test_##name_##_far_absolute(values[i], expected[i], \
+                                                     tol);                   \
+            }                                                                \
+            break;                                                           \
+        }                                                                    \
+                                                                             \
+        case TEST_TOLERANCE_RELATIVE: {                                      \
+            type_ tol;                                                       \
+                                                                             \
+            tol = (type_)tolerance;                                          \
+            for (size_t i = 0; i < n; i++) {                                 \
+                count += test_##name_##_far_relative(values[i], expected[i], \
+                                                     tol);                   \
+            }                                                                \
+            break;                                                           \
+        }                                                                    \
+                                                                             \
+        case TEST_TOLERANCE_ULP: {                                           \
+            uint_ tol;                                                       \
+                                                                             \
+            tol = (uint_)tolerance;                                          \
+            for (size_t i = 0; i < n; i++) {                                 \
+                count += test_##name_##_far_ulp(values[i], expected[i],      \
+                                                tol);                        \
+            }                                                                \
+            break;                                                           \
+        }                                                                    \
+        }                                                                    \
+                                                                             \
+        return count;                                                        \
+    }                                                                        \
+                                                                             \
+    void                                                                     \
+    test_fail_##name_##_array_near(struct test_context *ctx,                 \
+                                   const char *file, int line,               \
+                                   const char *expr, const type_ *values,    \
+                                   const type_ *expected, size_t n,          \
+                                   enum test_tolerance mode,                 \
+                                   double tolerance) {                       \
+        char offenders[TEST_ERROR_BUFSZ];                                    \
+        size_t nb_far, nb_offenders, worst_idx, len;                         \
+        double worst_error;                                                  \
+                                                                             \
+        if (!test_tolerance_is_valid(mode, tolerance, ulp_max_)) {           \
+            test_abort(ctx, file, line, "%s: invalid tolerance %g for %s",   \
+                       expr, tolerance, test_tolerance_string(mode));        \
+        }                                                                    \
+                                                                             \
+        nb_far = 0;                                                          \
+        nb_offenders = 0;                                                    \
+        worst_idx = 0;                                                       \
+        worst_error = -1.0;                                                  \
+                                                                             \
+        offenders[0] = '\0';                                                 \
+        len = 0;                                                             \
+                                                                             \
+        for (size_t i = 0; i < n; i++) {                                     \
+            double error;                                                    \
+                                                                             \
+            if (!test_##name_##_far(values[i], expected[i], mode, tolerance)) \
+                continue;                                                    \
+                                                                             \
+            nb_far++;                                                        \
+                                                                             \
+            error = test_##name_##_error(values[i], expected[i], mode);      \
+            if (error > worst_error) {                                       \
+                worst_error = error;                                         \
+                worst_idx = i;                                               \
+            }                                                                \
+                                                                             \
+            if (nb_offenders < TEST_ARRAY_NB_OFFENDERS                       \
+             && len < sizeof(offenders)) {                                   \
+                int ret;                                                     \
+                                                                             \
+                ret = snprintf(offenders + len, sizeof(offenders) - len,     \
+                               "%s[%zu] "fmt_" instead of "fmt_,             \
+                               (nb_offenders > 0) ? ", " : "", i,            \
+                               (double)values[i], (double)expected[i]);      \
+                if (ret > 0)                                                 \
+                    len += (size_t)ret;                                      \
+                nb_offenders++;                                              \
+            }                                                                \
+        }                                                                    \
+                                                                             \
+        test_abort(ctx, file, line,                                          \
+                   "%s has %zu of %zu elements out of tolerance "            \
+                   "(%s <= %g); worst error %g at index %zu "                \
+                   "("fmt_" instead of "fmt_"); first offenders: %s",        \
+                   expr, nb_far, n, test_tolerance_string(mode), tolerance,  \
+                   worst_error, worst_idx, (double)values[worst_idx],        \
+                   (double)expected[worst_idx], offenders);                  \
+    }
+
+TEST_DEFINE_ARRAY_NEAR(float, float, int32_t, uint32_t, fabsf, "%.9g", 0x1p32)
+TEST_DEFINE_ARRAY_NEAR(double, double, int64_t, uint64_t, fabs, "%.17g",
+                       0x1p64)
+
+const char *
+test_tolerance_string(enum test_tolerance mode) {
+    switch (mode) {
+    case TEST_TOLERANCE_ABSOLUTE:
+        return "absolute error";
+    case TEST_TOLERANCE_RELATIVE:
+        return "relative error";
+    case TEST_TOLERANCE_ULP:
+        return "ulp";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Number of bytes of each side shown around the first difference */
+#define TEST_GOLDEN_EXCERPT_SZ 40
+
+/* Makes temporary file names unique between threads of the process */
+static atomic_uint test_golden_nb_tmp_files;
+
+static void test_golden_update(struct test_context *, const char *, int,
+                               const char *, const void *, size_t);
+static void test_golden_compare(const char *, const char *, size_t,
+                                const char *, size_t, const char *,
+                                char *, size_t);
+static char *test_golden_excerpt(const char *, size_t, size_t);
+
+void
+test_check_file_eq(struct test_context *ctx, const char *file, int line,
+                   const char *expr, const void *value, size_t value_sz,
+                   const char *path) {
+    char errmsg[TEST_ERROR_BUFSZ];
+    struct stat st;
+    const char *golden;
+    size_t golden_sz;
+    int fd;
+
+    if (ctx->test_suite->update_golden) {
+        test_golden_update(ctx, file, line, path, value, value_sz);
+        return;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        test_abort(ctx, file, line, "cannot open golden file %s: %s",
+                   path, strerror(errno));
+    }
+
+    if (fstat(fd, &st) == -1) {
+        int saved_errno;
+
+        saved_errno = errno;
+        close(fd);
+        test_abort(ctx, file, line, "cannot stat golden file %s: %s",
+                   path, strerror(saved_errno));
+    }
+
+    golden_sz = (size_t)st.st_size;
+
+    /* mmap() rejects empty mappings */
+    if (golden_sz == 0) {
+        close(fd);
+
+        if (value_sz > 0) {
+            test_abort(ctx, file, line,
+                       "%s is %zu bytes long but golden file %s is empty",
+                       expr, value_sz, path);
+        }
+
+        return;
+    }
+
+    golden = mmap(NULL, golden_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (golden == MAP_FAILED) {
+        int saved_errno;
+
+        saved_errno = errno;
+        close(fd);
+        test_abort(ctx, file, line, "cannot map golden file %s: %s",
+                   path, strerror(saved_errno));
+    }
+
+    close(fd);
+
+    if (value_sz == golden_sz && memcmp(value, golden, golden_sz) == 0) {
+        munmap((void *)golden, golden_sz);
+        return;
+    }
+
+    /* The message must be built before unmapping the file since the test
+     * is aborted with longjmp() */
+    test_golden_compare(expr, value, value_sz, golden, golden_sz, path,
+                        errmsg, sizeof(errmsg));
+    munmap((void *)golden, golden_sz);
+
+    test_abort(ctx, file, line, "%s", errmsg);
+}
+
+static void
+test_golden_update(struct test_context *ctx, const char *file, int line,
+                   const char *path, const void *value, size_t value_sz) {
+    char *tmp_path, *dir_path, *dir;
+    struct stat st;
+    const char *ptr;
+    size_t path_len, tmp_path_sz, len;
+    int fd, dir_fd;
+
+    /* The file is written next to the golden file, then renamed over it,
+     * so that readers never see a partially written file */
+    path_len = strlen(path);
+    tmp_path_sz = path_len + 32;
+    tmp_path = test_malloc(tmp_path_sz);
+
+    /* Unlike mkstemp(), open() applies the umask to new files */
+    do {
+        snprintf(tmp_path, tmp_path_sz, "%s.%ld.%u", path, (long)getpid(),
+                 atomic_fetch_add(&test_golden_nb_tmp_files, 1));
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    } while (fd == -1 && errno == EEXIST);
+
+    if (fd == -1) {
+        int saved_errno;
+
+        saved_errno = errno;
+        free(tmp_path);
+        test_abort(ctx, file, line, "cannot create temporary file for %s: %s",
+                   path, strerror(saved_errno));
+    }
+
+    /* An existing golden file keeps its mode */
+    if (stat(path, &st) == 0) {
+        if (fchmod(fd, st.st_mode & 07777) == -1)
+            goto error;
+    } else if (errno != ENOENT) {
+        goto error;
+    }
+
+    ptr = value;
+    len = value_sz;
+    while (len > 0) {
+        ssize_t ret;
+
+        ret = write(fd, ptr, len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+
+        ptr += ret;
+        len -= (size_t)ret;
+    }
+
+    if (fsync(fd) == -1)
+        goto error;
+
+    if (close(fd) == -1) {
+        fd = -1;
+        goto error;
+    }
+    fd = -1;
+
+    if (rename(tmp_path, path) == -1)
+        goto error;
+
+    /* Make the rename itself durable */
+    dir_path = test_malloc(path_len + 1);
+    memcpy(dir_path, path, path_len + 1);
+    dir = dirname(dir_path);
+
+    dir_fd = open(dir, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    free(dir_path);
+    free(tmp_path);
+    return;
+
+error:
+    {
+        char errmsg[TEST_ERROR_BUFSZ];
+
+        snprintf(errmsg, sizeof(errmsg), "cannot update golden file %s: %s",
+                 path, strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+
+        test_abort(ctx, file, line, "%s", errmsg);
+    }
+}
+
+static void
+test_golden_compare(const char *expr, const char *value, size_t value_sz,
+                    const char *golden, size_t golden_sz, const char *path,
+                    char *buf, size_t bufsz) {
+    char *value_str, *golden_str;
+    size_t offset, min_sz, line, column, line_start;
+
+    min_sz = (value_sz < golden_sz) ? value_sz : golden_sz;
+
+    for (offset = 0; offset < min_sz; offset++) {
+        if (value[offset] != golden[offset])
+            break;
+    }
+
+    line = 1;
+    line_start = 0;
+    for (size_t i = 0; i < offset; i++) {
+        if (golden[i] == '\n') {
+            line++;
+            line_start = i + 1;
+        }
+    }
+
+    column = offset - line_start + 1;
+
+    if (offset == min_sz) {
+        snprintf(buf, bufsz,
+                 "%s is %zu bytes long but golden file %s is %zu bytes long "
+                 "(contents are identical up to offset %zu, line %zu, "
+                 "column %zu)",
+                 expr, value_sz, path, golden_sz, offset, line, column);
+        return;
+    }
+
+    value_str = test_golden_excerpt(value, value_sz, offset);
+    golden_str = test_golden_excerpt(golden, golden_sz, offset);
+
+    snprintf(buf, bufsz,
+             "%s differs from golden file %s at offset %zu (line %zu, "
+             "column %zu): \"%s\" but should be \"%s\"",
+             expr, path, offset, line, column, value_str, golden_str);
+
+    free(value_str);
+    free(golden_str);
+}
+
+static char *
+test_golden_excerpt(const char *data, size_t sz, size_t offset) {
+    size_t len;
+
+    len = sz - offset;
+    if (len > TEST_GOLDEN_EXCERPT_SZ)
+        len = TEST_GOLDEN_EXCERPT_SZ;
+
+    return test_format_data(data + offset, len);
+}
@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+/* Each thread appends operations to its own buffer, allocated before the
+ * run and aligned on cache lines, so that recording neither synchronizes
+ * threads nor allocates memory. Timestamps come from the monotonic clock,
+ * which is consistent across cpus. */
+
+#define TEST_HISTORY_CACHE_LINE 64
+
+#define TEST_HISTORY_MAX_REPORTED_OPS 8
+
+struct test_history_recorder {
+    struct test_history_op *ops;
+    size_t nb_ops;
+    size_t max_ops;
+    unsigned int thread;
+    bool overflow;
+} __attribute__((aligned(TEST_HISTORY_CACHE_LINE)));
+
+struct test_history {
+    struct test_history_recorder *recorders;
+    size_t nb_recorders;
+};
+
+/* Checking follows the algorithm of Wing and Gong as improved by Lowe:
+ * calls and returns form a list ordered by time; an operation can be
+ * linearized when its call is reached, and reaching a return whose call
+ * was not linearized means backtracking. Configurations (set of linearized
+ * operations and model state) already explored are cached. Pending
+ * operations, which never returned, can be linearized anywhere after their
+ * call or not at all. */
+
+struct test_history_entry {
+    bool is_call;
+    size_t op;
+    uint64_t time;
+
+    struct test_history_entry *match;
+    struct test_history_entry *prev;
+    struct test_history_entry *next;
+};
+
+struct test_history_cache {
+    unsigned char **keys;
+    size_t nb_keys;
+    size_t size;
+    size_t key_sz;
+};
+
+static size_t test_history_cut(const struct test_history_op **, size_t,
+                               uint64_t, struct test_history_op *,
+                               const struct test_history_op **);
+static bool test_history_check(const struct test_model *,
+                               const struct test_history_op **, size_t);
+static int test_history_op_cmp(const void *, const void *);
+static int test_history_time_cmp(const void *, const void *);
+static int test_history_entry_cmp(const void *, const void *);
+static void test_history_lift(struct test_history_entry *);
+static void test_history_unlift(struct test_history_entry *);
+static bool test_history_cache_add(struct test_history_cache *,
+                                   const unsigned char *);
+static void test_history_cache_free(struct test_history_cache *);
+static uint64_t test_history_hash(const unsigned char *, size_t);
+static void test_history_format_op(char *, size_t, const struct test_model *,
+                                   const struct test_history_op *);
+
+struct test_history *
+test_history_new(size_t nb_threads, size_t max_ops) {
+    struct test_history *history;
+
+    history = test_malloc(sizeof(struct test_history));
+    memset(history, 0, sizeof(struct test_history));
+
+    history->recorders = aligned_alloc(TEST_HISTORY_CACHE_LINE,
+        nb_threads * sizeof(struct test_history_recorder));
+    if (!history->recorders) {
+        fprintf(stderr, "cannot allocate %zu bytes: %s\n",
+                nb_threads * sizeof(struct test_history_recorder),
+                strerror(errno));
+        abort();
+    }
+
+    history->nb_recorders = nb_threads;
+
+    for (size_t i = 0; i < nb_threads; i++) {
+        struct test_history_recorder *recorder;
+
+        recorder = history->recorders + i;
+        memset(recorder, 0, sizeof(struct test_history_recorder));
+
+        recorder->ops = test_malloc(max_ops * sizeof(struct test_history_op));
+        recorder->max_ops = max_ops;
+        recorder->thread = (unsigned int)i;
+
+        /* Fault pages in now rather than during the run */
+        memset(recorder->ops, 0, max_ops * sizeof(struct test_history_op));
+    }
+
+    return history;
+}
+
+void
+test_history_delete(struct test_history *history) {
+    if (!history)
+        return;
+
+    for (size_t i = 0; i < history->nb_recorders; i++)
+        free(history->recorders[i].ops);
+    free(history->recorders);
+
+    memset(history, 0, sizeof(struct test_history));
+    free(history);
+}
+
+struct test_history_recorder *
+test_history_recorder(struct test_history *history, size_t thread) {
+    return history->recorders + thread;
+}
+
+size_t
+test_history_invoke(struct test_history_recorder *recorder,
+                    int function, intptr_t argument) {
+    struct test_history_op *op;
+
+    if (recorder->nb_ops >= recorder->max_ops) {
+        recorder->overflow = true;
+        return SIZE_MAX;
+    }
+
+    op = recorder->ops + recorder->nb_ops;
+    op->thread = recorder->thread;
+    op->function = function;
+    op->argument = argument;
+    op->result = 0;
+    op->response_time = 0;
+    op->invoke_time = test_now();
+
+    return recorder->nb_ops++;
+}
+
+void
+test_history_respond(struct test_history_recorder *recorder, size_t id,
+                     intptr_t result) {
+    struct test_history_op *op;
+
+    if (id == SIZE_MAX)
+        return;
+
+    op = recorder->ops + id;
+    op->response_time = test_now();
+    op->result = result;
+}
+
+void
+test_check_linearizable(struct test_context *ctx, const char *file, int line,
+                        const char *expr,
+                        const struct test_history *history,
+                        const struct test_model *model) {
+    const struct test_history_op **ops, **prefix_ops;
+    struct test_history_op *prefix;
+    char errmsg[TEST_ERROR_BUFSZ];
+    size_t nb_ops, nb_total_ops, nb_prefix_ops, len, lo, hi, first;
+    uint64_t *times;
+    size_t nb_times;
+
+    nb_total_ops = 0;
+    for (size_t i = 0; i < history->nb_recorders; i++) {
+        const struct test_history_recorder *recorder;
+
+        recorder = history->recorders + i;
+        if (recorder->overflow) {
+            test_abort(ctx, file, line,
+                       "%s overflowed the buffer of thread %u (%zu operations)",
+                       expr, recorder->thread, recorder->max_ops);
+        }
+
+        nb_total_ops += recorder->nb_ops;
+    }
+
+    ops = test_malloc((nb_total_ops + 1) * sizeof(struct test_history_op *));
+    nb_ops = 0;
+
+    for (size_t i = 0; i < history->nb_recorders; i++) {
+        const struct test_history_recorder *recorder;
+
+        recorder = history->recorders + i;
+        for (size_t j = 0; j < recorder->nb_ops; j++)
+            ops[nb_ops++] = recorder->ops + j;
+    }
+
+    if (test_history_check(model, ops, nb_ops)) {
+        free(ops);
+        return;
+    }
+
+    /* Look for the earliest invocation or response after which the history
+     * stops being linearizable, keeping operations still running at that
+     * point as pending. Linearizability is closed under such prefixes, so
+     * once a prefix fails, all longer ones fail. Removing operations instead is
+     * not useful with stateful models: any operation alone is enough to
+     * make the history inconsistent once the ones preceding it are
+     * removed. Checking is much faster on linearizable prefixes, so the
+     * length is doubled first, then refined by bisection. */
+    qsort(ops, nb_ops, sizeof(struct test_history_op *),
+          test_history_op_cmp);
+
+    times = test_malloc(2 * nb_ops * sizeof(uint64_t));
+    nb_times = 0;
+
+    for (size_t i = 0; i < nb_ops; i++) {
+        times[nb_times++] = ops[i]->invoke_time;
+        if (ops[i]->response_time > 0)
+            times[nb_times++] = ops[i]->response_time;
+    }
+
+    qsort(times, nb_times, sizeof(uint64_t), test_history_time_cmp);
+
+    prefix = test_malloc(nb_ops * sizeof(struct test_history_op));
+    prefix_ops = test_malloc(nb_ops * sizeof(struct test_history_op *));
+
+    /* Cutting after the last event gives the whole history, which is known
+     * to fail */
+    lo = 0;
+    hi = 1;
+    while (hi < nb_times) {
+        nb_prefix_ops = test_history_cut(ops, nb_ops, times[hi - 1],
+                                         prefix, prefix_ops);
+        if (!test_history_check(model, prefix_ops, nb_prefix_ops))
+            break;
+
+        lo = hi;
+        hi *= 2;
+    }
+
+    if (hi > nb_times)
+        hi = nb_times;
+
+    while (hi - lo > 1) {
+        size_t mid;
+
+        mid = lo + (hi - lo) / 2;
+        nb_prefix_ops = test_history_cut(ops, nb_ops, times[mid - 1],
+                                         prefix, prefix_ops);
+        if (test_history_check(model, prefix_ops, nb_prefix_ops)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    nb_prefix_ops = test_history_cut(ops, nb_ops, times[hi - 1],
+                                     prefix, prefix_ops);
+    free(times);
+
+    first = (nb_prefix_ops > TEST_HISTORY_MAX_REPORTED_OPS)
+          ? nb_prefix_ops - TEST_HISTORY_MAX_REPORTED_OPS : 0;
+
+    len = (size_t)snprintf(errmsg, sizeof(errmsg),
+                           "%s is not linearizable (%zu operations); "
+                           "the shortest failing prefix has %zu operations "
+                           "and ends with:", expr, nb_total_ops,
+                           nb_prefix_ops);
+
+    for (size_t i = first; i < nb_prefix_ops && len < sizeof(errmsg); i++) {
+        const struct test_history_op *op;
+        char op_string[128];
+
+        op = prefix_ops[i];
+        test_history_format_op(op_string, sizeof(op_string), model, op);
+
+        if (op->response_time == 0) {
+            len += (size_t)snprintf(errmsg + len, sizeof(errmsg) - len,
+                                    "\n  thread %u: %s [%"PRIu64", pending]",
+                                    op->thread, op_string,
+                                    op->invoke_time - ops[0]->invoke_time);
+        } else {
+            len += (size_t)snprintf(errmsg + len, sizeof(errmsg) - len,
+                                    "\n  thread %u: %s [%"PRIu64", %"PRIu64"]",
+                                    op->thread, op_string,
+                                    op->invoke_time - ops[0]->invoke_time,
+                                    op->response_time - ops[0]->invoke_time);
+        }
+    }
+
+    free(prefix_ops);
+    free(prefix);
+    free(ops);
+
+    test_abort(ctx, file, line, "%s", errmsg);
+}
+
+static size_t
+test_history_cut(const struct test_history_op **ops, size_t nb_ops,
+                 uint64_t time, struct test_history_op *prefix,
+                 const struct test_history_op **prefix_ops) {
+    size_t nb_prefix_ops;
+
+    /* Operations are sorted by invocation time; the ones still running at
+     * the time of the cut become pending */
+    nb_prefix_ops = 0;
+    while (nb_prefix_ops < nb_ops
+        && ops[nb_prefix_ops]->invoke_time <= time) {
+        struct test_history_op *op;
+
+        op = prefix + nb_prefix_ops;
+        *op = *ops[nb_prefix_ops];
+        if (op->response_time > time) {
+            op->response_time = 0;
+            op->result = 0;
+        }
+
+        prefix_ops[nb_prefix_ops++] = op;
+    }
+
+    return nb_prefix_ops;
+}
+
+static bool
+test_history_check(const struct test_model *model,
+                   const struct test_history_op **ops, size_t nb_ops) {
+    struct test_history_entry *entries, head, *entry;
+    struct test_history_entry **calls, **stack;
+    struct test_history_cache cache;
+    unsigned char *key, *states, *state;
+    uint64_t *linearized;
+    size_t nb_words, nb_calls;
+    bool ok;
+
+    if (nb_ops == 0)
+        return true;
+
+    entries = test_malloc(2 * nb_ops * sizeof(struct test_history_entry));
+
+    for (size_t i = 0; i < nb_ops; i++) {
+        struct test_history_entry *call, *ret;
+
+        call = entries + 2 * i;
+        ret = entries + 2 * i + 1;
+
+        call->is_call = true;
+        call->op = i;
+        call->time = ops[i]->invoke_time;
+
+        /* Pending operations may or may not have taken effect: they
+         * return after everything else, and reaching their return means
+         * that all completed operations were linearized */
+        ret->is_call = false;
+        ret->op = i;
+        ret->time = (ops[i]->response_time > 0)
+                  ? ops[i]->response_time : UINT64_MAX;
+    }
+
+    qsort(entries, 2 * nb_ops, sizeof(struct test_history_entry),
+          test_history_entry_cmp);
+
+    /* Entries do not move anymore, link them */
+    calls = test_malloc(nb_ops * sizeof(struct test_history_entry *));
+
+    head.prev = NULL;
+    head.next = entries;
+
+    for (size_t i = 0; i < 2 * nb_ops; i++) {
+        entries[i].prev = (i == 0) ? &head : entries + i - 1;
+        entries[i].next = (i == 2 * nb_ops - 1) ? NULL : entries + i + 1;
+
+        if (entries[i].is_call)
+            calls[entries[i].op] = entries + i;
+    }
+
+    for (size_t i = 0; i < 2 * nb_ops; i++) {
+        if (!entries[i].is_call) {
+            entries[i].match = calls[entries[i].op];
+            calls[entries[i].op]->match = entries + i;
+        }
+    }
+
+    /* The key of a configuration is the set of linearized operations
+     * followed by the state of the model */
+    nb_words = (nb_ops + 63) / 64;
+
+    memset(&cache, 0, sizeof(struct test_history_cache));
+    cache.key_sz = nb_words * sizeof(uint64_t) + model->state_size;
+
+    key = test_malloc(cache.key_sz);
+    memset(key, 0, cache.key_sz);
+    linearized = (uint64_t *)key;
+    state = key + nb_words * sizeof(uint64_t);
+
+    if (model->init)
+        model->init(state);
+
+    /* Linearized calls and the states preceding them */
+    stack = test_malloc(nb_ops * sizeof(struct test_history_entry *));
+    states = test_malloc((nb_ops + 1) * (model->state_size + 1));
+    nb_calls = 0;
+
+    ok = true;
+    entry = head.next;
+
+    while (head.next) {
+        if (entry->is_call) {
+            unsigned char *saved;
+            size_t op;
+
+            op = entry->op;
+            saved = states + nb_calls * model->state_size;
+            memcpy(saved, state, model->state_size);
+
+            if (model->step(state, ops[op])) {
+                linearized[op / 64] |= UINT64_C(1) << (op % 64);
+
+                if (test_history_cache_add(&cache, key)) {
+                    stack[nb_calls++] = entry;
+                    test_history_lift(entry);
+                    entry = head.next;
+                    continue;
+                }
+
+                linearized[op / 64] &= ~(UINT64_C(1) << (op % 64));
+            }
+
+            memcpy(state, saved, model->state_size);
+            entry = entry->next;
+        } else {
+            size_t op;
+
+            if (ops[entry->op]->response_time == 0)
+                break;
+
+            if (nb_calls == 0) {
+                ok = false;
+                break;
+            }
+
+            /* Undo the last linearized operation and try the next one */
+            entry = stack[--nb_calls];
+            op = entry->op;
+
+            memcpy(state, states + nb_calls * model->state_size,
+                   model->state_size);
+            linearized[op / 64] &= ~(UINT64_C(1) << (op % 64));
+
+            test_history_unlift(entry);
+            entry = entry->next;
+        }
+    }
+
+    test_history_cache_free(&cache);
+    free(states);
+    free(key);
+    free(stack);
+    free(calls);
+    free(entries);
+
+    return ok;
+}
+
+static int
+test_history_op_cmp(const void *p1, const void *p2) {
+    const struct test_history_op *op1, *op2;
+
+    op1 = *(const struct test_history_op * const *)p1;
+    op2 = *(const struct test_history_op * const *)p2;
+
+    if (op1->invoke_time < op2->invoke_time)
+        return -1;
+    if (op1->invoke_time > op2->invoke_time)
+        return 1;
+
+    return 0;
+}
+
+static int
+test_history_time_cmp(const void *p1, const void *p2) {
+    uint64_t t1, t2;
+
+    t1 = *(const uint64_t *)p1;
+    t2 = *(const uint64_t *)p2;
+
+    if (t1 < t2)
+        return -1;
+    if (t1 > t2)
+        return 1;
+
+    return 0;
+}
+
+static int
+test_history_entry_cmp(const void *p1, const void *p2) {
+    const struct test_history_entry *e1, *e2;
+
+    e1 = p1;
+    e2 = p2;
+
+    if (e1->time < e2->time)
+        return -1;
+    if (e1->time > e2->time)
+        return 1;
+
+    /* Operations whose bounds share a timestamp are considered concurrent,
+     * so calls go first */
+    if (e1->is_call != e2->is_call)
+        return e1->is_call ? -1 : 1;
+
+    return 0;
+}
+
+static void
+test_history_lift(struct test_history_entry *call) {
+    struct test_history_entry *ret;
+
+    call->prev->next = call->next;
+    if (call->next)
+        call->next->prev = call->prev;
+
+    ret = call->match;
+    ret->prev->next = ret->next;
+    if (ret->next)
+        ret->next->prev = ret->prev;
+}
+
+static void
+test_history_unlift(struct test_history_entry *call) {
+    struct test_history_entry *ret;
+
+    ret = call->match;
+    ret->prev->next = ret;
+    if (ret->next)
+        ret->next->prev = ret;
+
+    call->prev->next = call;
+    if (call->next)
+        call->next->prev = call;
+}
+
+static bool
+test_history_cache_add(struct test_history_cache *cache,
+                       const unsigned char *key) {
+    uint64_t hash;
+    size_t idx;
+
+    if (cache->nb_keys * 2 >= cache->size) {
+        unsigned char **keys;
+        size_t size;
+
+        size = (cache->size > 0) ? cache->size * 2 : 1024;
+        keys = test_malloc(size * sizeof(unsigned char *));
+        memset(keys, 0, size * sizeof(unsigned char *));
+
+        for (size_t i = 0; i < cache->size; i++) {
+            if (!cache->keys[i])
+                continue;
+
+            idx = test_history_hash(cache->keys[i], cache->key_sz)
+                & (size - 1);
+            while (keys[idx])
+                idx = (idx + 1) & (size - 1);
+            keys[idx] = cache->keys[i];
+        }
+
+        free(cache->keys);
+        cache->keys = keys;
+        cache->size = size;
+    }
+
+    hash = test_history_hash(key, cache->key_sz);
+    idx = hash & (cache->size - 1);
+
+    while (cache->keys[idx]) {
+        if (memcmp(cache->keys[idx], key, cache->key_sz) == 0)
+            return false;
+
+        idx = (idx + 1) & (cache->size - 1);
+    }
+
+    cache->keys[idx] = test_malloc(cache->key_sz);
+    memcpy(cache->keys[idx], key, cache->key_sz);
+    cache->nb_keys++;
+
+    return true;
+}
+
+static void
+test_history_cache_free(struct test_history_cache *cache) {
+    for (size_t i = 0; i < cache->size; i++)
+        free(cache->keys[i]);
+    free(cache->keys);
+}
+
+static uint64_t
+test_history_hash(const unsigned char *data, size_t sz) {
+    uint64_t hash;
+
+    /* FNV-1a */
+    hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < sz; i++) {
+        hash ^= data[i];
+        hash *= UINT64_C(1099511628211);
+    }
+
+    return hash;
+}
+
+static void
+test_history_format_op(char *buf, size_t sz, const struct test_model *model,
+                       const struct test_history_op *op) {
+    if (model->format) {
+        model->format(buf, sz, op);
+    } else {
+        snprintf(buf, sz, "%d(%"PRIdPTR") -> %"PRIdPTR,
+                 op->function, op->argument, op->result);
+    }
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef UTEST_INTERNAL_H
+#define UTEST_INTERNAL_H
+
+#include <setjmp.h>
+#include <time.h>
+
+#include "utest.h"
+
+#define TEST_ERROR_BUFSZ 1024
+
+#define TEST_CRASH_MAX_FRAMES 64
+
+struct test {
+    const char *name;
+    test_function function;
+};
+
+struct test_suite {
+    const char *name;
+
+    struct test_reporter *reporters;
+    size_t nb_reporters;
+
+    FILE **outputs;
+    size_t nb_outputs;
+
+    /* Paths opened from the command line, "-" being stdout */
+    char **output_paths;
+    size_t nb_output_paths;
+
+    struct test_record *records;
+    size_t nb_records;
+    size_t batch_size;
+
+    size_t nb_tests;
+    size_t nb_failed_tests;
+    size_t nb_passed_tests;
+
+    uint64_t start_time;
+
+    struct test *registered_tests;
+    size_t nb_registered_tests;
+
+    size_t nb_repetitions; /* 0 if unlimited */
+    bool until_fail;
+    uint64_t repeat_duration; /* nanoseconds */
+    size_t nb_jobs;
+    bool shuffle;
+    uint64_t seed;
+
+    size_t nb_runs;
+    size_t nb_failed_runs;
+
+    bool update_golden;
+    bool catch_signals;
+
+    struct test *async_tests;
+    size_t nb_async_tests;
+    size_t async_limit;
+
+    bool virtual_time;
+
+    unsigned int progress_interval; /* milliseconds */
+
+    bool capture_output;
+    size_t capture_limit; /* bytes */
+    struct test_capture *capture;
+
+    struct test_profiler *profiler;
+
+    int benchmark_cpu;
+    size_t benchmark_nb_samples;
+    uint64_t benchmark_warmup; /* milliseconds */
+    bool benchmark_flush_caches;
+    double benchmark_noise_threshold;
+    unsigned char *benchmark_flush_buffer;
+    size_t benchmark_flush_buffer_sz;
+};
+
+struct test_context {
+    const char *test_name;
+    struct test_suite *test_suite;
+
+    const char *file;
+    int line;
+    char errmsg[TEST_ERROR_BUFSZ];
+    char *message; /* used instead of errmsg when too long for it */
+
+    /* Only set when the test was killed by a signal */
+    int signo;
+    void *fault_address;
+    void *frames[TEST_CRASH_MAX_FRAMES];
+    int nb_frames;
+    char backtrace[4096];
+    struct test_crash crash;
+
+    /* Only set while virtual time is enabled */
+    struct test_vclock *vclock;
+
+    /* Only set for async tests */
+    struct test_async *async;
+
+    sigjmp_buf before;
+};
+
+/* Suite */
+void test_suite_plan_tests(struct test_suite *, size_t);
+void test_suite_begin_test(struct test_suite *, const char *);
+void test_suite_report(struct test_suite *, const struct test_record *);
+int test_suite_execute(struct test_suite *, struct test_context *,
+                       const char *, test_function, struct test_record *,
+                       bool);
+
+/* Context */
+const char *test_context_message(const struct test_context *);
+void test_abort_message(struct test_context *, const char *, int, char *)
+    __attribute__((noreturn));
+
+/* Crashes */
+void test_crash_install(void);
+void test_crash_uninstall(void);
+void test_crash_enter(struct test_context *);
+void test_crash_leave(void);
+void test_crash_release_thread(void);
+void test_crash_format(struct test_context *);
+
+/* Benchmarks */
+bool test_benchmark_is_valid_cpu(int);
+
+/* Repetition */
+bool test_suite_is_repeating(const struct test_suite *);
+int test_suite_repeat(struct test_suite *, const struct test *, size_t);
+void test_shuffle(size_t *, size_t, uint64_t *);
+uint64_t test_random_seed(void);
+
+/* Utils */
+void *test_malloc(size_t);
+void *test_realloc(void *, size_t);
+char *test_strdup(const char *);
+char *test_strndup(const char *, size_t);
+uint64_t test_now(void);
+
+/* Diff */
+char *test_diff_lines(const char *, const char *, size_t *, size_t *);
+
+/* Virtual time, only defined when linking with libutest_vtime.a */
+struct test_vclock;
+
+void test_vclock_start(struct test_context *) __attribute__((weak));
+void test_vclock_stop(struct test_context *) __attribute__((weak));
+int test_vclock_real_clock_gettime(clockid_t, struct timespec *)
+    __attribute__((weak));
+
+/* Output capture */
+struct test_capture;
+
+struct test_capture *test_capture_new(size_t);
+void test_capture_delete(struct test_capture *);
+
+void test_capture_start(struct test_capture *);
+const char *test_capture_stop(struct test_capture *);
+
+/* Profiler */
+struct test_profiler;
+
+struct test_profiler *test_profiler_new(FILE *);
+void test_profiler_delete(struct test_profiler *);
+
+void test_profiler_start(struct test_profiler *);
+void test_profiler_stop(struct test_profiler *, const char *);
+
+#endif
@@ -21,73 +21,242 @@
 
 char *test_json_escape(const char *);
 
-void
-test_report_json(FILE *output, const char *test_name, bool success,
-                 const char *file, int line, const char *errmsg) {
-    static __thread bool first_report = true;
+static void test_json_begin_suite(void *, const char *);
+static void test_json_end_suite(void *, const struct test_results *);
+static void test_json_end_test(void *, const struct test_record *, size_t);
+static void test_json_flush(void *);
+static void test_json_free_data(void *);
 
-    char *escaped_test_name;
+struct test_json_reporter {
+    FILE *output;
+    bool first_report;
+};
 
-    if (first_report) {
-        fprintf(output, "     ");
-    } else {
-        fprintf(output, "    ,");
+struct test_reporter
+test_reporter_json(FILE *output) {
+    struct test_json_reporter *json;
+    struct test_reporter reporter;
+
+    json = malloc(sizeof(struct test_json_reporter));
+    if (!json) {
+        fprintf(stderr, "cannot allocate %zu bytes: %s\n",
+                sizeof(struct test_json_reporter), strerror(errno));
+        abort();
     }
 
-    escaped_test_name = test_json_escape(test_name);
-    fprintf(output, "\"%s\": {\n", escaped_test_name);
-    free(escaped_test_name);
+    json->output = output;
+    json->first_report = true;
 
-    if (success) {
-        fprintf(output,
-                "      \"passed\": true\n");
-    } else {
-        char *escaped_errmsg;
+    memset(&reporter, 0, sizeof(struct test_reporter));
 
-        escaped_errmsg = test_json_escape(errmsg);
+    reporter.begin_suite = test_json_begin_suite;
+    reporter.end_suite = test_json_end_suite;
+    reporter.end_test = test_json_end_test;
+    reporter.flush = test_json_flush;
+    reporter.free_data = test_json_free_data;
+    reporter.data = json;
 
-        fprintf(output,
-                "      \"passed\": false,\n"
-                "      \"file\": \"%s\",\n"
-                "      \"line\": %d,\n"
-                "      \"error_message\": \"%s\"\n",
-                file, line, escaped_errmsg);
+    return reporter;
+}
 
-        free(escaped_errmsg);
-    }
+static void
+test_json_end_test(void *data, const struct test_record *records,
+                   size_t nb_records) {
+    struct test_json_reporter *json;
+    FILE *output;
+
+    json = data;
+    output = json->output;
+
+    for (size_t i = 0; i < nb_records; i++) {
+        const struct test_record *record;
+        char *escaped_test_name;
+
+        record = records + i;
+
+        if (json->first_report) {
+            fprintf(output, "     ");
+        } else {
+            fprintf(output, "    ,");
+        }
+
+        /* Tests are an array since the same test can be reported several
+         * times */
+        escaped_test_name = test_json_escape(record->test_name);
+        fprintf(output, "{\n"
+                "      \"name\": \"%s\",\n", escaped_test_name);
+        free(escaped_test_name);
+
+        if (record->status == TEST_STATUS_PASSED) {
+            fprintf(output,
+                    "      \"passed\": true,\n");
+        } else {
+            char *escaped_file, *escaped_errmsg;
+
+            escaped_file = test_json_escape(record->file);
+            escaped_errmsg = test_json_escape(record->message);
+
+            fprintf(output,
+                    "      \"passed\": false,\n"
+                    "      \"file\": \"%s\",\n"
+                    "      \"line\": %d,\n"
+                    "      \"error_message\": \"%s\",\n",
+                    escaped_file, record->line, escaped_errmsg);
+
+            free(escaped_file);
+            free(escaped_errmsg);
+        }
+
+        if (record->output) {
+            char *escaped_output;
+
+            escaped_output = test_json_escape(record->output);
+            fprintf(output, "      \"output\": \"%s\",\n", escaped_output);
+            free(escaped_output);
+        }
+
+        if (record->crash) {
+            char *escaped_backtrace;
+
+            escaped_backtrace = test_json_escape(record->crash->backtrace);
+
+            fprintf(output,
+                    "      \"crash\": {\n"
+                    "        \"signal\": %d,\n"
+                    "        \"address\": \"%p\",\n"
+                    "        \"backtrace\": \"%s\"\n"
+                    "      },\n",
+                    record->crash->signo, record->crash->address,
+                    escaped_backtrace);
+
+            free(escaped_backtrace);
+        }
+
+        if (record->benchmark) {
+            const struct test_benchmark *benchmark;
+
+            benchmark = record->benchmark;
+
+            fprintf(output,
+                    "      \"benchmark\": {\n"
+                    "        \"nb_samples\": %zu,\n"
+                    "        \"nb_iterations\": %zu,\n"
+                    "        \"cpu\": %d,\n"
+                    "        \"mean\": %.3f,\n"
+                    "        \"stddev\": %.3f,\n"
+                    "        \"min\": %.3f,\n"
+                    "        \"cv\": %.6f,\n"
+                    "        \"noisy\": %s,\n"
+                    "        \"noise\": [",
+                    benchmark->nb_samples, benchmark->nb_iterations,
+                    benchmark->cpu, benchmark->mean, benchmark->stddev,
+                    benchmark->min, benchmark->cv,
+                    benchmark->noise ? "true" : "false");
+
+            for (unsigned int flag = 1, n = 0; flag <= TEST_NOISE_SMT;
+                 flag <<= 1) {
+                if (!(benchmark->noise & flag))
+                    continue;
+
+                fprintf(output, "%s\"%s\"",
+                        (n++ > 0) ? ", " : "", test_noise_string(flag));
+            }
+
+            fprintf(output, "]\n"
+                    "      },\n");
+        }
+
+        if (record->repetitions) {
+            const struct test_repetitions *repetitions;
 
-    fprintf(output, "    }\n");
+            repetitions = record->repetitions;
+
+            fprintf(output,
+                    "      \"repetitions\": {\n"
+                    "        \"nb_runs\": %zu,\n"
+                    "        \"nb_failures\": %zu,\n"
+                    "        \"flake_rate\": %.6f\n"
+                    "      },\n",
+                    repetitions->nb_runs, repetitions->nb_failures,
+                    (repetitions->nb_runs > 0)
+                    ? (double)repetitions->nb_failures
+                      / (double)repetitions->nb_runs
+                    : 0.0);
+        }
 
-    first_report = false;
+        fprintf(output,
+                "      \"duration\": %"PRIu64"\n"
+                "    }\n",
+                record->duration);
+
+        json->first_report = false;
+    }
 }
 
-void
-test_print_header_json(FILE *output, const char *suite_name) {
+static void
+test_json_begin_suite(void *data, const char *suite_name) {
+    struct test_json_reporter *json;
     char *escaped_suite_name;
 
+    json = data;
+
     escaped_suite_name = test_json_escape(suite_name);
 
-    fprintf(output,
+    fprintf(json->output,
             "{\n"
             "  \"name\": \"%s\",\n"
-            "  \"tests\": {\n",
+            "  \"tests\": [\n",
             escaped_suite_name);
 
     free(escaped_suite_name);
 }
 
-void
-test_print_results_json(FILE *output, size_t nb_tests,
-                        size_t nb_passed_tests, size_t nb_failed_tests) {
-    fprintf(output,
-            "  },\n"
+static void
+test_json_end_suite(void *data, const struct test_results *results) {
+    struct test_json_reporter *json;
+
+    json = data;
+
+    fprintf(json->output,
+            "  ],\n"
             "  \"results\": {\n"
             "    \"nb_tests\": %zu,\n"
             "    \"nb_passed_tests\": %zu,\n"
-            "    \"nb_failed_tests\": %zu\n"
+            "    \"nb_failed_tests\": %zu,\n",
+            results->nb_tests, results->nb_passed_tests,
+            results->nb_failed_tests);
+
+    if (results->nb_runs > 0) {
+        fprintf(json->output,
+                "    \"nb_runs\": %zu,\n"
+                "    \"nb_failed_runs\": %zu,\n",
+                results->nb_runs, results->nb_failed_runs);
+    }
+
+    if (results->shuffled) {
+        fprintf(json->output,
+                "    \"seed\": %"PRIu64",\n",
+                results->seed);
+    }
+
+    fprintf(json->output,
+            "    \"duration\": %"PRIu64"\n"
             "  }\n"
             "}\n",
-            nb_tests, nb_passed_tests, nb_failed_tests);
+            results->duration);
+}
+
+static void
+test_json_flush(void *data) {
+    struct test_json_reporter *json;
+
+    json = data;
+    fflush(json->output);
+}
+
+static void
+test_json_free_data(void *data) {
+    free(data);
 }
 
 char *
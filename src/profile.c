@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* Samples are taken every millisecond of CPU time of the thread running the
+ * test; the buffer holds about eight seconds of CPU time per test. The timer
+ * only signals this thread, so that other threads, such as the output
+ * capture reader or threads created by the test, are not sampled. */
+#define TEST_PROFILE_INTERVAL     1000 /* microseconds */
+#define TEST_PROFILE_MAX_SAMPLES  8192
+#define TEST_PROFILE_MAX_FRAMES   64
+
+/* Frames of the signal handler and of the signal trampoline */
+#define TEST_PROFILE_SKIPPED_FRAMES 2
+
+struct test_profile_sample {
+    int nb_frames;
+    void *frames[TEST_PROFILE_MAX_FRAMES];
+};
+
+struct test_profile_stack {
+    char *folded;
+    size_t count;
+};
+
+struct test_profiler {
+    FILE *output;
+
+    struct test_profile_sample *samples;
+    volatile sig_atomic_t nb_samples;
+    volatile sig_atomic_t nb_dropped_samples;
+
+    /* Stack of the caller of test_suite_execute(), removed from samples */
+    void *base_frames[TEST_PROFILE_MAX_FRAMES];
+    int nb_base_frames;
+
+    timer_t timer;
+
+    /* Profiler of an enclosing suite, for suites run by tests */
+    struct test_profiler *previous;
+};
+
+/* Each timer signals the thread it profiles */
+static _Thread_local struct test_profiler *test_active_profiler;
+
+/* The handler is shared by all threads and installed while at least one
+ * of them is profiled */
+static pthread_mutex_t test_profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t test_profiler_nb_running;
+static struct sigaction test_profiler_old_action;
+
+static void test_profiler_handle_signal(int, siginfo_t *, void *);
+static int test_profiler_strip_base(const struct test_profiler *,
+                                    const struct test_profile_sample *);
+static char *test_profiler_fold(const char *,
+                                const struct test_profile_sample *, int);
+static void test_profiler_append_frame(char **, size_t *, size_t *, void *);
+static int test_profile_stack_cmp(const void *, const void *);
+
+struct test_profiler *
+test_profiler_new(FILE *output) {
+    struct test_profiler *profiler;
+    void *frame;
+
+    profiler = test_malloc(sizeof(struct test_profiler));
+    memset(profiler, 0, sizeof(struct test_profiler));
+
+    profiler->output = output;
+    profiler->samples = test_malloc(TEST_PROFILE_MAX_SAMPLES
+                                    * sizeof(struct test_profile_sample));
+
+    /* The first call to backtrace() loads the unwinder, which allocates
+     * memory and must not happen in a signal handler */
+    backtrace(&frame, 1);
+
+    return profiler;
+}
+
+void
+test_profiler_delete(struct test_profiler *profiler) {
+    if (!profiler)
+        return;
+
+    free(profiler->samples);
+
+    memset(profiler, 0, sizeof(struct test_profiler));
+    free(profiler);
+}
+
+void
+test_profiler_start(struct test_profiler *profiler) {
+    struct sigaction action;
+    struct sigevent event;
+    struct itimerspec timer;
+    void *frames[TEST_PROFILE_MAX_FRAMES];
+    int nb_frames;
+
+    /* frames[0] is this function and frames[1] test_suite_execute() */
+    nb_frames = backtrace(frames, TEST_PROFILE_MAX_FRAMES);
+    if (nb_frames > 2) {
+        profiler->nb_base_frames = nb_frames - 2;
+        memcpy(profiler->base_frames, frames + 2,
+               (size_t)profiler->nb_base_frames * sizeof(void *));
+    } else {
+        profiler->nb_base_frames = 0;
+    }
+
+    profiler->nb_samples = 0;
+    profiler->nb_dropped_samples = 0;
+
+    profiler->previous = test_active_profiler;
+    test_active_profiler = profiler;
+
+    pthread_mutex_lock(&test_profiler_mutex);
+
+    if (test_profiler_nb_running++ == 0) {
+        memset(&action, 0, sizeof(struct sigaction));
+        action.sa_sigaction = test_profiler_handle_signal;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(SIGPROF, &action, &test_profiler_old_action) == -1) {
+            fprintf(stderr, "cannot install SIGPROF handler: %s\n",
+                    strerror(errno));
+            abort();
+        }
+    }
+
+    pthread_mutex_unlock(&test_profiler_mutex);
+
+    memset(&event, 0, sizeof(struct sigevent));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event,
+                     &profiler->timer) == -1) {
+        fprintf(stderr, "cannot create profiling timer: %s\n",
+                strerror(errno));
+        abort();
+    }
+
+    memset(&timer, 0, sizeof(struct itimerspec));
+    timer.it_interval.tv_nsec = TEST_PROFILE_INTERVAL * 1000;
+    timer.it_value.tv_nsec = TEST_PROFILE_INTERVAL * 1000;
+
+    if (timer_settime(profiler->timer, 0, &timer, NULL) == -1) {
+        fprintf(stderr, "cannot start profiling timer: %s\n",
+                strerror(errno));
+        abort();
+    }
+}
+
+void
+test_profiler_stop(struct test_profiler *profiler, const char *test_name) {
+    struct test_profile_stack *stacks;
+    size_t nb_samples;
+
+    /* Deleting the timer discards its pending signal */
+    timer_delete(profiler->timer);
+
+    pthread_mutex_lock(&test_profiler_mutex);
+    if (--test_profiler_nb_running == 0)
+        sigaction(SIGPROF, &test_profiler_old_action, NULL);
+    pthread_mutex_unlock(&test_profiler_mutex);
+
+    test_active_profiler = profiler->previous;
+
+    nb_samples = (size_t)profiler->nb_samples;
+    if (profiler->nb_dropped_samples > 0) {
+        fprintf(stderr, "%s: %d profiling samples dropped\n",
+                test_name, (int)profiler->nb_dropped_samples);
+    }
+
+    if (nb_samples == 0)
+        return;
+
+    /* Fold each sample, then merge identical stacks */
+    stacks = test_malloc(nb_samples * sizeof(struct test_profile_stack));
+
+    for (size_t i = 0; i < nb_samples; i++) {
+        const struct test_profile_sample *sample;
+        int nb_frames;
+
+        sample = profiler->samples + i;
+        nb_frames = test_profiler_strip_base(profiler, sample);
+
+        stacks[i].folded = test_profiler_fold(test_name, sample, nb_frames);
+        stacks[i].count = 1;
+    }
+
+    qsort(stacks, nb_samples, sizeof(struct test_profile_stack),
+          test_profile_stack_cmp);
+
+    for (size_t i = 0; i < nb_samples;) {
+        size_t j;
+
+        for (j = i + 1; j < nb_samples; j++) {
+            if (strcmp(stacks[i].folded, stacks[j].folded) != 0)
+                break;
+        }
+
+        fprintf(profiler->output, "%s %zu\n", stacks[i].folded, j - i);
+        i = j;
+    }
+
+    fflush(profiler->output);
+
+    for (size_t i = 0; i < nb_samples; i++)
+        free(stacks[i].folded);
+    free(stacks);
+}
+
+static void
+test_profiler_handle_signal(int signo, siginfo_t *info, void *uctx) {
+    struct test_profiler *profiler;
+    struct test_profile_sample *sample;
+    int saved_errno;
+
+    profiler = test_active_profiler;
+    if (!profiler)
+        return;
+
+    if (profiler->nb_samples >= TEST_PROFILE_MAX_SAMPLES) {
+        profiler->nb_dropped_samples++;
+        return;
+    }
+
+    saved_errno = errno;
+
+    sample = profiler->samples + profiler->nb_samples;
+    sample->nb_frames = backtrace(sample->frames, TEST_PROFILE_MAX_FRAMES);
+    profiler->nb_samples++;
+
+    errno = saved_errno;
+}
+
+static int
+test_profiler_strip_base(const struct test_profiler *profiler,
+                         const struct test_profile_sample *sample) {
+    int nb_frames, nb_base_frames;
+
+    nb_frames = sample->nb_frames;
+    nb_base_frames = profiler->nb_base_frames;
+
+    /* The sample ends with the frames of the callers of
+     * test_suite_execute(), followed by the frame of test_suite_execute()
+     * itself and the frame of the test function, which is already named by
+     * the root of the folded stack. Truncated samples are kept whole. */
+    if (nb_frames < TEST_PROFILE_SKIPPED_FRAMES + nb_base_frames + 2)
+        return nb_frames;
+
+    for (int i = 1; i <= nb_base_frames; i++) {
+        if (sample->frames[nb_frames - i]
+            != profiler->base_frames[nb_base_frames - i]) {
+            return nb_frames;
+        }
+    }
+
+    return nb_frames - nb_base_frames - 2;
+}
+
+static char *
+test_profiler_fold(const char *test_name,
+                   const struct test_profile_sample *sample, int nb_frames) {
+    char *folded;
+    size_t len, sz;
+
+    sz = 256;
+    folded = test_malloc(sz);
+
+    len = strlen(test_name);
+    if (len + 1 > sz) {
+        sz = len + 1;
+        folded = test_realloc(folded, sz);
+    }
+    memcpy(folded, test_name, len + 1);
+
+    /* Folded stacks start with the outermost frame */
+    for (int i = nb_frames - 1; i >= TEST_PROFILE_SKIPPED_FRAMES; i--)
+        test_profiler_append_frame(&folded, &len, &sz, sample->frames[i]);
+
+    return folded;
+}
+
+static void
+test_profiler_append_frame(char **pfolded, size_t *plen, size_t *psz,
+                           void *address) {
+    char frame[256];
+    Dl_info info;
+    size_t frame_len;
+
+    memset(&info, 0, sizeof(Dl_info));
+
+    if (dladdr(address, &info) == 0) {
+        snprintf(frame, sizeof(frame), "[%p]", address);
+    } else if (info.dli_sname) {
+        snprintf(frame, sizeof(frame), "%s", info.dli_sname);
+    } else if (info.dli_fname) {
+        const char *name;
+
+        name = strrchr(info.dli_fname, '/');
+        name = name ? name + 1 : info.dli_fname;
+
+        snprintf(frame, sizeof(frame), "[%s+0x%zx]", name,
+                 (size_t)((char *)address - (char *)info.dli_fbase));
+    } else {
+        snprintf(frame, sizeof(frame), "[%p]", address);
+    }
+
+    frame_len = strlen(frame);
+
+    if (*plen + frame_len + 2 > *psz) {
+        *psz = (*plen + frame_len + 2) * 2;
+        *pfolded = test_realloc(*pfolded, *psz);
+    }
+
+    (*pfolded)[(*plen)++] = ';';
+    memcpy(*pfolded + *plen, frame, frame_len + 1);
+    *plen += frame_len;
+}
+
+static int
+test_profile_stack_cmp(const void *p1, const void *p2) {
+    const struct test_profile_stack *s1, *s2;
+
+    s1 = p1;
+    s2 = p2;
+
+    return strcmp(s1->folded, s2->folded);
+}
+
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Repetitions are grouped in rounds; a round runs every selected test once,
+ * in a random order if shuffling is enabled. The order of a round only
+ * depends on the seed and on the index of the round, so that a failing
+ * round can be reproduced whatever the number of jobs. */
+
+struct test_repeat_stats {
+    size_t nb_runs;
+    size_t nb_failures;
+    uint64_t duration;
+
+    /* First failure, in round order */
+    size_t failure_round;
+    const char *file;
+    int line;
+    char *message;
+    char *output;
+};
+
+struct test_repeat {
+    struct test_suite *suite;
+    const struct test *tests;
+    size_t nb_tests;
+
+    pthread_mutex_t mutex;
+    size_t next_round;
+    size_t max_rounds;
+    uint64_t deadline;
+    atomic_bool stop;
+
+    /* Set if the output of each run is captured on its own */
+    bool capture_runs;
+};
+
+struct test_repeat_worker {
+    struct test_repeat *repeat;
+    struct test_repeat_stats *stats;
+    pthread_t thread;
+};
+
+static void *test_repeat_worker_main(void *);
+static void test_repeat_run_round(struct test_repeat_worker *, size_t,
+                                  size_t *);
+static bool test_repeat_next_round(struct test_repeat *, size_t *);
+static uint64_t test_splitmix64(uint64_t *);
+
+bool
+test_suite_is_repeating(const struct test_suite *suite) {
+    return suite->nb_repetitions > 1 || suite->until_fail
+        || suite->repeat_duration > 0;
+}
+
+int
+test_suite_repeat(struct test_suite *suite, const struct test *tests,
+                  size_t nb_tests) {
+    struct test_repeat repeat;
+    struct test_repeat_worker *workers;
+    struct test_repeat_stats *stats;
+    const char *output;
+    size_t nb_jobs;
+    bool capture_all;
+    int ret;
+
+    memset(&repeat, 0, sizeof(struct test_repeat));
+    repeat.suite = suite;
+    repeat.tests = tests;
+    repeat.nb_tests = nb_tests;
+    atomic_init(&repeat.stop, false);
+
+    /* Without an explicit count, --until-fail and --duration run as many
+     * rounds as needed */
+    if (suite->nb_repetitions > 0) {
+        repeat.max_rounds = suite->nb_repetitions;
+    } else {
+        repeat.max_rounds = SIZE_MAX;
+    }
+
+    if (suite->repeat_duration > 0)
+        repeat.deadline = test_now() + suite->repeat_duration;
+
+    pthread_mutex_init(&repeat.mutex, NULL);
+
+    nb_jobs = (suite->nb_jobs > 0) ? suite->nb_jobs : 1;
+
+    /* Runs on several threads share the same output, which can only be
+     * captured as a whole and goes with every failed test */
+    capture_all = suite->capture && nb_jobs > 1;
+    repeat.capture_runs = suite->capture && nb_jobs == 1;
+
+    if (capture_all)
+        test_capture_start(suite->capture);
+
+    workers = test_malloc(nb_jobs * sizeof(struct test_repeat_worker));
+    for (size_t i = 0; i < nb_jobs; i++) {
+        workers[i].repeat = &repeat;
+        workers[i].stats = test_malloc(nb_tests
+                                       * sizeof(struct test_repeat_stats));
+        memset(workers[i].stats, 0,
+               nb_tests * sizeof(struct test_repeat_stats));
+    }
+
+    /* The calling thread is the first worker */
+    for (size_t i = 1; i < nb_jobs; i++) {
+        int err;
+
+        err = pthread_create(&workers[i].thread, NULL,
+                             test_repeat_worker_main, workers + i);
+        if (err != 0) {
+            fprintf(stderr, "cannot create thread: %s\n", strerror(err));
+            abort();
+        }
+    }
+
+    test_repeat_worker_main(workers);
+
+    for (size_t i = 1; i < nb_jobs; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    output = capture_all ? test_capture_stop(suite->capture) : NULL;
+
+    pthread_mutex_destroy(&repeat.mutex);
+
+    /* Merge the statistics of all workers and report one record per test */
+    stats = workers[0].stats;
+
+    for (size_t i = 1; i < nb_jobs; i++) {
+        for (size_t j = 0; j < nb_tests; j++) {
+            struct test_repeat_stats *wstats;
+
+            wstats = workers[i].stats + j;
+
+            stats[j].nb_runs += wstats->nb_runs;
+            stats[j].nb_failures += wstats->nb_failures;
+            stats[j].duration += wstats->duration;
+
+            if (wstats->message
+             && (!stats[j].message
+              || wstats->failure_round < stats[j].failure_round)) {
+                free(stats[j].message);
+                free(stats[j].output);
+
+                stats[j].failure_round = wstats->failure_round;
+                stats[j].file = wstats->file;
+                stats[j].line = wstats->line;
+                stats[j].message = wstats->message;
+                stats[j].output = wstats->output;
+            } else {
+                free(wstats->message);
+                free(wstats->output);
+            }
+        }
+
+        free(workers[i].stats);
+    }
+
+    ret = 0;
+
+    for (size_t i = 0; i < nb_tests; i++) {
+        struct test_repetitions repetitions;
+        struct test_record record;
+        char *errmsg;
+
+        test_suite_begin_test(suite, tests[i].name);
+
+        memset(&repetitions, 0, sizeof(struct test_repetitions));
+        repetitions.nb_runs = stats[i].nb_runs;
+        repetitions.nb_failures = stats[i].nb_failures;
+
+        memset(&record, 0, sizeof(struct test_record));
+        record.test_name = tests[i].name;
+        record.repetitions = &repetitions;
+
+        errmsg = NULL;
+
+        if (stats[i].nb_runs > 0)
+            record.duration = stats[i].duration / stats[i].nb_runs;
+
+        suite->nb_runs += stats[i].nb_runs;
+        suite->nb_failed_runs += stats[i].nb_failures;
+
+        if (stats[i].nb_failures > 0) {
+            size_t len;
+
+            /* The first failure may have a message of any length */
+            len = strlen(stats[i].message) + 128;
+            errmsg = test_malloc(len);
+            snprintf(errmsg, len,
+                     "failed %zu of %zu runs (%.2f%%), first in round %zu: %s",
+                     stats[i].nb_failures, stats[i].nb_runs,
+                     (double)stats[i].nb_failures * 100.0
+                     / (double)stats[i].nb_runs,
+                     stats[i].failure_round, stats[i].message);
+
+            record.status = TEST_STATUS_FAILED;
+            record.file = stats[i].file;
+            record.line = stats[i].line;
+            record.message = errmsg;
+            record.output = capture_all ? output : stats[i].output;
+
+            suite->nb_failed_tests++;
+            ret = -1;
+        } else {
+            record.status = TEST_STATUS_PASSED;
+            suite->nb_passed_tests++;
+        }
+
+        test_suite_report(suite, &record);
+
+        free(errmsg);
+        free(stats[i].message);
+        free(stats[i].output);
+    }
+
+    free(stats);
+    free(workers);
+
+    return ret;
+}
+
+void
+test_shuffle(size_t *indexes, size_t nb_indexes, uint64_t *state) {
+    /* Fisher-Yates */
+    for (size_t i = nb_indexes; i > 1; i--) {
+        size_t j, tmp;
+
+        j = (size_t)(test_splitmix64(state) % i);
+
+        tmp = indexes[i - 1];
+        indexes[i - 1] = indexes[j];
+        indexes[j] = tmp;
+    }
+}
+
+uint64_t
+test_random_seed(void) {
+    uint64_t state;
+
+    state = test_now() ^ ((uint64_t)getpid() << 32);
+    return test_splitmix64(&state);
+}
+
+static void *
+test_repeat_worker_main(void *arg) {
+    struct test_repeat_worker *worker;
+    size_t *order;
+    size_t round;
+
+    worker = arg;
+
+    order = test_malloc((worker->repeat->nb_tests + 1) * sizeof(size_t));
+
+    while (test_repeat_next_round(worker->repeat, &round))
+        test_repeat_run_round(worker, round, order);
+
+    free(order);
+
+    /* Each worker thread has its own alternate signal stack */
+    if (worker->repeat->suite->catch_signals)
+        test_crash_release_thread();
+
+    return NULL;
+}
+
+static void
+test_repeat_run_round(struct test_repeat_worker *worker, size_t round,
+                      size_t *order) {
+    struct test_repeat *repeat;
+    struct test_suite *suite;
+
+    repeat = worker->repeat;
+    suite = repeat->suite;
+
+    for (size_t i = 0; i < repeat->nb_tests; i++)
+        order[i] = i;
+
+    if (suite->shuffle) {
+        uint64_t state;
+
+        state = suite->seed + round;
+        test_shuffle(order, repeat->nb_tests, &state);
+    }
+
+    for (size_t i = 0; i < repeat->nb_tests; i++) {
+        const struct test *test;
+        struct test_repeat_stats *stats;
+        struct test_context ctx;
+        struct test_record record;
+        const char *output;
+
+        if (atomic_load(&repeat->stop))
+            return;
+        if (repeat->deadline > 0 && test_now() >= repeat->deadline)
+            return;
+
+        test = repeat->tests + order[i];
+        stats = worker->stats + order[i];
+
+        if (repeat->capture_runs)
+            test_capture_start(suite->capture);
+
+        test_suite_execute(suite, &ctx, test->name, test->function,
+                           &record, false);
+
+        output = NULL;
+        if (repeat->capture_runs)
+            output = test_capture_stop(suite->capture);
+
+        stats->nb_runs++;
+        stats->duration += record.duration;
+
+        if (record.status == TEST_STATUS_PASSED)
+            continue;
+
+        stats->nb_failures++;
+
+        if (!stats->message || round < stats->failure_round) {
+            free(stats->message);
+            free(stats->output);
+
+            stats->failure_round = round;
+            stats->file = record.file;
+            stats->line = record.line;
+            stats->message = test_strdup(record.message);
+            stats->output = output ? test_strdup(output) : NULL;
+        }
+
+        free(ctx.message);
+
+        if (suite->until_fail)
+            atomic_store(&repeat->stop, true);
+    }
+}
+
+static bool
+test_repeat_next_round(struct test_repeat *repeat, size_t *pround) {
+    bool ok;
+
+    if (atomic_load(&repeat->stop))
+        return false;
+    if (repeat->deadline > 0 && test_now() >= repeat->deadline)
+        return false;
+
+    pthread_mutex_lock(&repeat->mutex);
+
+    ok = repeat->next_round < repeat->max_rounds;
+    if (ok)
+        *pround = repeat->next_round++;
+
+    pthread_mutex_unlock(&repeat->mutex);
+
+    return ok;
+}
+
+static uint64_t
+test_splitmix64(uint64_t *state) {
+    uint64_t z;
+
+    z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
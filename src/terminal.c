@@ -17,33 +17,158 @@
 #include <ctype.h>
 #include <stdio.h>
 
-#include "utest.h"
+#include <unistd.h>
 
+#include "internal.h"
+
+/* The progress reporter only prints failures and benchmark results, and
+ * redraws a single status line at most once per interval, so that the cost
+ * of reporting does not grow with the number of passing tests. */
+struct test_progress_reporter {
+    FILE *output;
+    uint64_t interval; /* nanoseconds */
+
+    uint64_t start_time;
+    uint64_t last_draw_time;
+    bool drawn;
+
+    size_t nb_planned_tests;
+    size_t nb_tests;
+    size_t nb_failed_tests;
+};
+
+static void test_terminal_print_record(FILE *, const struct test_record *);
+static void test_terminal_print_lines(FILE *, const char *);
 static char *test_escape_string_for_display(const char *);
 
-void
-test_report_terminal(FILE *output, const char *test_name, bool success,
-                     const char *file, int line, const char *errmsg) {
+static void test_terminal_begin_suite(void *, const char *);
+static void test_terminal_end_suite(void *, const struct test_results *);
+static void test_terminal_end_test(void *, const struct test_record *, size_t);
+static void test_terminal_flush(void *);
+
+static void test_progress_begin_suite(void *, const char *);
+static void test_progress_end_suite(void *, const struct test_results *);
+static void test_progress_plan_tests(void *, size_t);
+static void test_progress_end_test(void *, const struct test_record *, size_t);
+static void test_progress_flush(void *);
+static void test_progress_free_data(void *);
+static void test_progress_draw(struct test_progress_reporter *, uint64_t);
+static void test_progress_erase(struct test_progress_reporter *);
+
+struct test_reporter
+test_reporter_terminal(FILE *output) {
+    struct test_reporter reporter;
+
+    memset(&reporter, 0, sizeof(struct test_reporter));
+
+    reporter.begin_suite = test_terminal_begin_suite;
+    reporter.end_suite = test_terminal_end_suite;
+    reporter.end_test = test_terminal_end_test;
+    reporter.flush = test_terminal_flush;
+    reporter.data = output;
+
+    return reporter;
+}
+
+struct test_reporter
+test_reporter_progress(FILE *output, unsigned int interval) {
+    struct test_progress_reporter *progress;
+    struct test_reporter reporter;
+
+    /* A status line redrawn in place only makes sense on a terminal */
+    if (!isatty(fileno(output)))
+        return test_reporter_terminal(output);
+
+    progress = test_malloc(sizeof(struct test_progress_reporter));
+    memset(progress, 0, sizeof(struct test_progress_reporter));
+    progress->output = output;
+    progress->interval = (uint64_t)interval * 1000000;
+
+    memset(&reporter, 0, sizeof(struct test_reporter));
+
+    reporter.begin_suite = test_progress_begin_suite;
+    reporter.end_suite = test_progress_end_suite;
+    reporter.plan_tests = test_progress_plan_tests;
+    reporter.end_test = test_progress_end_test;
+    reporter.flush = test_progress_flush;
+    reporter.free_data = test_progress_free_data;
+    reporter.data = progress;
+
+    return reporter;
+}
+
+static void
+test_terminal_end_test(void *data, const struct test_record *records,
+                       size_t nb_records) {
+    FILE *output;
+
+    output = data;
+
+    for (size_t i = 0; i < nb_records; i++)
+        test_terminal_print_record(output, records + i);
+}
+
+static void
+test_terminal_print_record(FILE *output, const struct test_record *record) {
+    if (record->status == TEST_STATUS_PASSED && record->benchmark) {
+        const struct test_benchmark *benchmark;
+
+        benchmark = record->benchmark;
+
+        fprintf(output, "\e[32m.\e[0m %-24s  \e[32mok\e[0m  "
+                "%.1f ns +/- %.1f%%  (min %.1f ns, %zu x %zu)",
+                record->test_name, benchmark->mean,
+                benchmark->cv * 100.0, benchmark->min,
+                benchmark->nb_samples, benchmark->nb_iterations);
 
-    if (success) {
+        if (benchmark->noise) {
+            fprintf(output, "  \e[33mnoisy: %s\e[0m",
+                    test_noise_string(benchmark->noise));
+        }
+
+        fputc('\n', output);
+    } else if (record->status == TEST_STATUS_PASSED
+            && record->repetitions) {
+        fprintf(output, "\e[32m.\e[0m %-24s  \e[32mok\e[0m  "
+                "%zu runs, %.3f us per run\n",
+                record->test_name, record->repetitions->nb_runs,
+                (double)record->duration / 1e3);
+    } else if (record->status == TEST_STATUS_PASSED) {
         fprintf(output, "\e[32m.\e[0m %-24s  \e[32mok\e[0m\n",
-                test_name);
+                record->test_name);
     } else {
-        char *escaped_errmsg;
+        char *first_line, *escaped_errmsg;
+        size_t len;
 
-        escaped_errmsg = test_escape_string_for_display(errmsg);
+        /* Details such as diffs follow the first line of the message */
+        len = strcspn(record->message, "\n");
+        first_line = test_strndup(record->message, len);
+        escaped_errmsg = test_escape_string_for_display(first_line);
 
         fprintf(output, "\e[31mx\e[0m %-24s  %s:%d  \e[31m%s\e[0m\n",
-                test_name, file, line, escaped_errmsg);
+                record->test_name, record->file, record->line,
+                escaped_errmsg);
 
         free(escaped_errmsg);
+        free(first_line);
+
+        if (record->message[len] == '\n')
+            test_terminal_print_lines(output, record->message + len + 1);
+
+        if (record->crash)
+            test_terminal_print_lines(output, record->crash->backtrace);
+        if (record->output)
+            test_terminal_print_lines(output, record->output);
     }
 }
 
-void
-test_print_header_terminal(FILE *output, const char *suite_name) {
+static void
+test_terminal_begin_suite(void *data, const char *suite_name) {
+    FILE *output;
     size_t width;
 
+    output = data;
+
     fprintf(output, "-- %s ", suite_name);
 
     width = 78;
@@ -59,22 +184,179 @@ test_print_header_terminal(FILE *output, const char *suite_name) {
     fputc('\n', output);
 }
 
-void
-test_print_results_terminal(FILE *output, size_t nb_tests,
-                            size_t nb_passed_tests, size_t nb_failed_tests) {
+static void
+test_terminal_end_suite(void *data, const struct test_results *results) {
+    FILE *output;
     double ratio_passed, ratio_failed;
 
-    ratio_passed = (double)nb_passed_tests / (double)nb_tests;
-    ratio_failed = (double)nb_failed_tests / (double)nb_tests;
+    output = data;
+
+    ratio_passed = (double)results->nb_passed_tests
+                 / (double)results->nb_tests;
+    ratio_failed = (double)results->nb_failed_tests
+                 / (double)results->nb_tests;
 
     putc('\n', output);
 
     fprintf(output, "%-16s  %zu\n", "Tests executed:",
-            nb_tests);
+            results->nb_tests);
     fprintf(output, "%-16s  %zu (%.0f%%)\n", "Tests passed:",
-            nb_passed_tests, ratio_passed * 100.0);
+            results->nb_passed_tests, ratio_passed * 100.0);
     fprintf(output, "%-16s  %zu (%.0f%%)\n", "Tests failed:",
-            nb_failed_tests, ratio_failed * 100.0);
+            results->nb_failed_tests, ratio_failed * 100.0);
+    if (results->nb_runs > 0) {
+        fprintf(output, "%-16s  %zu (%zu failed, %.4f%%)\n", "Runs executed:",
+                results->nb_runs, results->nb_failed_runs,
+                (double)results->nb_failed_runs * 100.0
+                / (double)results->nb_runs);
+    }
+    if (results->shuffled) {
+        fprintf(output, "%-16s  %"PRIu64"\n", "Seed:",
+                results->seed);
+    }
+    fprintf(output, "%-16s  %.3f ms\n", "Duration:",
+            (double)results->duration / 1e6);
+}
+
+static void
+test_terminal_flush(void *data) {
+    fflush(data);
+}
+
+static void
+test_progress_begin_suite(void *data, const char *suite_name) {
+    struct test_progress_reporter *progress;
+
+    progress = data;
+    progress->start_time = test_now();
+
+    test_terminal_begin_suite(progress->output, suite_name);
+}
+
+static void
+test_progress_end_suite(void *data, const struct test_results *results) {
+    struct test_progress_reporter *progress;
+
+    progress = data;
+
+    test_progress_erase(progress);
+    test_terminal_end_suite(progress->output, results);
+}
+
+static void
+test_progress_plan_tests(void *data, size_t nb_tests) {
+    struct test_progress_reporter *progress;
+
+    progress = data;
+    progress->nb_planned_tests += nb_tests;
+}
+
+static void
+test_progress_end_test(void *data, const struct test_record *records,
+                       size_t nb_records) {
+    struct test_progress_reporter *progress;
+    bool printed;
+    uint64_t now;
+
+    progress = data;
+    printed = false;
+
+    for (size_t i = 0; i < nb_records; i++) {
+        const struct test_record *record;
+
+        record = records + i;
+
+        progress->nb_tests++;
+        if (record->status != TEST_STATUS_PASSED)
+            progress->nb_failed_tests++;
+
+        if (record->status != TEST_STATUS_PASSED || record->benchmark) {
+            test_progress_erase(progress);
+            test_terminal_print_record(progress->output, record);
+            printed = true;
+        }
+    }
+
+    /* Tests run with TEST_RUN are not planned */
+    if (progress->nb_tests > progress->nb_planned_tests)
+        progress->nb_planned_tests = progress->nb_tests;
+
+    now = test_now();
+    if (printed || !progress->drawn
+     || now - progress->last_draw_time >= progress->interval) {
+        test_progress_draw(progress, now);
+    }
+}
+
+static void
+test_progress_flush(void *data) {
+    struct test_progress_reporter *progress;
+
+    progress = data;
+    fflush(progress->output);
+}
+
+static void
+test_progress_free_data(void *data) {
+    free(data);
+}
+
+static void
+test_progress_draw(struct test_progress_reporter *progress, uint64_t now) {
+    FILE *output;
+    double elapsed, rate;
+
+    output = progress->output;
+
+    elapsed = (double)(now - progress->start_time) / 1e9;
+    rate = (elapsed > 0.0) ? (double)progress->nb_tests / elapsed : 0.0;
+
+    fprintf(output, "\r\e[K[%zu/%zu]  ",
+            progress->nb_tests, progress->nb_planned_tests);
+
+    if (progress->nb_failed_tests > 0) {
+        fprintf(output, "\e[31m%zu failed\e[0m  ", progress->nb_failed_tests);
+    } else {
+        fprintf(output, "0 failed  ");
+    }
+
+    fprintf(output, "%.0f tests/s", rate);
+
+    if (rate > 0.0 && progress->nb_planned_tests > progress->nb_tests) {
+        fprintf(output, "  eta %.1f s",
+                (double)(progress->nb_planned_tests - progress->nb_tests)
+                / rate);
+    }
+
+    progress->last_draw_time = now;
+    progress->drawn = true;
+}
+
+static void
+test_progress_erase(struct test_progress_reporter *progress) {
+    if (!progress->drawn)
+        return;
+
+    fprintf(progress->output, "\r\e[K");
+    progress->drawn = false;
+}
+
+static void
+test_terminal_print_lines(FILE *output, const char *string) {
+    const char *ptr;
+
+    ptr = string;
+
+    while (*ptr != '\0') {
+        size_t len;
+
+        len = strcspn(ptr, "\n");
+        fprintf(output, "      %.*s\n", (int)len, ptr);
+
+        ptr += len;
+        if (*ptr == '\n')
+            ptr++;
+    }
 }
 
 static char *
@@ -84,7 +366,7 @@ test_escape_string_for_display(const char *string) {
 
     /* Even when escaping each character with its value (\xxx), we will never
      * use more than strlen(errmsg) * 4 bytes, plus 1 for the final \0 */
-    escaped_string = malloc(strlen(string) * 4 + 1);
+    escaped_string = test_malloc(strlen(string) * 4 + 1);
     optr = escaped_string;
 
     for (iptr = string; *iptr != '\0'; iptr++) {
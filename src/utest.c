@@ -20,56 +20,47 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
+#include <getopt.h>
 #include <unistd.h>
 
-#include "utest.h"
-
-#define TEST_ERROR_BUFSZ 1024
+#include "internal.h"
 
 static void test_usage(const char *, int)
     __attribute__ ((noreturn));
 static void test_die(const char *, ...)
     __attribute__ ((format(printf, 1, 2), noreturn));
 
-struct test_suite {
-    const char *name;
-
-    FILE *output;
-    test_header_printer header_printer;
-    test_result_printer result_printer;
-    test_report_function report_function;
-
-    size_t nb_tests;
-    size_t nb_failed_tests;
-    size_t nb_passed_tests;
-};
-
-struct test_context {
-    const char *test_name;
-    struct test_suite *test_suite;
-
-    jmp_buf before;
-};
+static void test_suite_add_format(struct test_suite *,
+                                  const char *, const char *);
+static FILE *test_open_output(struct test_suite *, const char *);
+static void test_suite_flush_records(struct test_suite *);
+static void test_record_copy(struct test_record *, const struct test_record *);
+static void test_record_free_copy(struct test_record *);
+static uint64_t test_parse_duration(const char *);
 
 struct test_suite *
 test_suite_new(const char *name) {
     struct test_suite *suite;
 
-    suite = malloc(sizeof(struct test_suite));
-    if (!suite) {
-        fprintf(stderr, "cannot allocate %zu bytes: %s\n",
-                sizeof(struct test_suite), strerror(errno));
-        abort();
-    }
+    suite = test_malloc(sizeof(struct test_suite));
     memset(suite, 0, sizeof(struct test_suite));
 
     suite->name = name;
+    suite->batch_size = 1;
 
-    suite->output = stdout;
-    suite->header_printer = test_print_header_terminal;
-    suite->result_printer = test_print_results_terminal;
-    suite->report_function = test_report_terminal;
+    suite->nb_repetitions = 1;
+    suite->seed = test_random_seed();
+
+    suite->async_limit = 256;
+    suite->capture_limit = 1024 * 1024;
+    suite->progress_interval = 100;
+
+    suite->benchmark_cpu = -1;
+    suite->benchmark_nb_samples = 30;
+    suite->benchmark_warmup = 100;
+    suite->benchmark_noise_threshold = 0.05;
 
     return suite;
 }
@@ -79,7 +70,38 @@ test_suite_delete(struct test_suite *suite) {
     if (!suite)
         return;
 
-    fclose(suite->output);
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->free_data)
+            reporter->free_data(reporter->data);
+    }
+    free(suite->reporters);
+
+    for (size_t i = 0; i < suite->nb_outputs; i++)
+        fclose(suite->outputs[i]);
+    free(suite->outputs);
+
+    for (size_t i = 0; i < suite->nb_output_paths; i++)
+        free(suite->output_paths[i]);
+    free(suite->output_paths);
+
+    for (size_t i = 0; i < suite->nb_records; i++)
+        test_record_free_copy(suite->records + i);
+    free(suite->records);
+
+    free(suite->registered_tests);
+    free(suite->async_tests);
+
+    if (suite->catch_signals) {
+        test_crash_uninstall();
+        test_crash_release_thread();
+    }
+
+    test_capture_delete(suite->capture);
+    test_profiler_delete(suite->profiler);
+    free(suite->benchmark_flush_buffer);
 
     memset(suite, 0, sizeof(struct test_suite));
     free(suite);
@@ -89,18 +111,148 @@ void
 test_suite_initialize_from_args(struct test_suite *suite,
                                 int argc, char **argv) {
     const char *output_path;
-    const char *format;
-    FILE *output;
-    int opt;
+    const char **formats;
+    size_t nb_formats;
+    int opt, cpu;
+
+    enum {
+        OPT_ASYNC_LIMIT = 256,
+        OPT_CAPTURE,
+        OPT_CAPTURE_LIMIT,
+        OPT_CATCH_SIGNALS,
+        OPT_FLUSH_CACHES,
+        OPT_NOISE_THRESHOLD,
+        OPT_REFRESH,
+        OPT_SAMPLES,
+        OPT_SHUFFLE,
+        OPT_UPDATE_GOLDEN,
+        OPT_VIRTUAL_TIME,
+        OPT_WARMUP,
+    };
+
+    static const struct option options[] = {
+        {"async-limit",     required_argument, NULL, OPT_ASYNC_LIMIT},
+        {"batch-size",      required_argument, NULL, 'b'},
+        {"capture",         no_argument,       NULL, OPT_CAPTURE},
+        {"capture-limit",   required_argument, NULL, OPT_CAPTURE_LIMIT},
+        {"catch-signals",   no_argument,       NULL, OPT_CATCH_SIGNALS},
+        {"cpu",             required_argument, NULL, 'c'},
+        {"duration",        required_argument, NULL, 'd'},
+        {"flush-caches",    no_argument,       NULL, OPT_FLUSH_CACHES},
+        {"format",          required_argument, NULL, 'f'},
+        {"help",            no_argument,       NULL, 'h'},
+        {"jobs",            required_argument, NULL, 'j'},
+        {"noise-threshold", required_argument, NULL, OPT_NOISE_THRESHOLD},
+        {"output",          required_argument, NULL, 'o'},
+        {"profile",         required_argument, NULL, 'p'},
+        {"refresh",         required_argument, NULL, OPT_REFRESH},
+        {"repeat",          required_argument, NULL, 'r'},
+        {"samples",         required_argument, NULL, OPT_SAMPLES},
+        {"seed",            required_argument, NULL, 's'},
+        {"shuffle",         no_argument,       NULL, OPT_SHUFFLE},
+        {"until-fail",      no_argument,       NULL, 'u'},
+        {"update-golden",   no_argument,       NULL, OPT_UPDATE_GOLDEN},
+        {"virtual-time",    no_argument,       NULL, OPT_VIRTUAL_TIME},
+        {"warmup",          required_argument, NULL, OPT_WARMUP},
+        {NULL,              0,                 NULL, 0},
+    };
 
     output_path = "-";
-    format = "terminal";
+
+    formats = test_malloc((size_t)argc * sizeof(const char *));
+    nb_formats = 0;
 
     opterr = 0;
-    while ((opt = getopt(argc, argv, "f:ho:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "b:c:d:f:hj:o:p:r:s:u",
+                              options, NULL)) != -1) {
         switch (opt) {
+        case OPT_ASYNC_LIMIT:
+            test_suite_set_async_limit(suite, strtoul(optarg, NULL, 10));
+            break;
+
+        case 'b':
+            test_suite_set_batch_size(suite, strtoul(optarg, NULL, 10));
+            break;
+
+        case OPT_CAPTURE:
+            test_suite_set_capture_output(suite, true);
+            break;
+
+        case OPT_CAPTURE_LIMIT:
+            test_suite_set_capture_limit(suite, strtoul(optarg, NULL, 10));
+            break;
+
+        case OPT_CATCH_SIGNALS:
+            test_suite_set_catch_signals(suite, true);
+            break;
+
+        case 'c':
+            cpu = atoi(optarg);
+            if (!test_benchmark_is_valid_cpu(cpu))
+                test_die("invalid cpu %s", optarg);
+            test_suite_set_benchmark_cpu(suite, cpu);
+            break;
+
+        case 'd':
+            test_suite_set_repeat_duration(suite,
+                                           test_parse_duration(optarg));
+            break;
+
+        case OPT_FLUSH_CACHES:
+            test_suite_set_benchmark_flush_caches(suite, true);
+            break;
+
+        case 'j':
+            test_suite_set_jobs(suite, strtoul(optarg, NULL, 10));
+            break;
+
+        case OPT_NOISE_THRESHOLD:
+            test_suite_set_benchmark_noise_threshold(suite,
+                                                     strtod(optarg, NULL));
+            break;
+
+        case OPT_REFRESH:
+            test_suite_set_progress_interval(suite,
+                                             (unsigned int)strtoul(optarg,
+                                                                   NULL, 10));
+            break;
+
+        case 'r':
+            test_suite_set_repetitions(suite, strtoul(optarg, NULL, 10));
+            break;
+
+        case 's':
+            test_suite_set_seed(suite, strtoull(optarg, NULL, 0));
+            break;
+
+        case OPT_SHUFFLE:
+            test_suite_set_shuffle(suite, true);
+            break;
+
+        case 'u':
+            test_suite_set_until_fail(suite, true);
+            break;
+
+        case OPT_UPDATE_GOLDEN:
+            test_suite_set_update_golden(suite, true);
+            break;
+
+        case OPT_VIRTUAL_TIME:
+            test_suite_set_virtual_time(suite, true);
+            break;
+
+        case OPT_SAMPLES:
+            test_suite_set_benchmark_samples(suite,
+                                             strtoul(optarg, NULL, 10));
+            break;
+
+        case OPT_WARMUP:
+            test_suite_set_benchmark_warmup(suite,
+                                            strtoull(optarg, NULL, 10));
+            break;
+
         case 'f':
-            format = optarg;
+            formats[nb_formats++] = optarg;
             break;
 
         case 'h':
@@ -111,89 +263,360 @@ test_suite_initialize_from_args(struct test_suite *suite,
             output_path = optarg;
             break;
 
+        case 'p':
+            test_suite_set_profile_output(suite, test_open_output(suite,
+                                                                  optarg));
+            break;
+
         case '?':
             test_usage(argv[0], 1);
         }
     }
 
-    /* Output */
-    if (strcmp(output_path, "-") == 0) {
-        output = stdout;
-    } else {
-        output = fopen(output_path, "w");
-        if (!output) {
-            test_die("cannot open file %s: %s",
-                     output_path, strerror(errno));
+    if (nb_formats == 0)
+        formats[nb_formats++] = "terminal";
+
+    for (size_t i = 0; i < nb_formats; i++) {
+        char *format, *colon;
+        const char *path;
+
+        format = test_strdup(formats[i]);
+
+        /* <format>:<path> overrides the default output */
+        colon = strchr(format, ':');
+        if (colon) {
+            *colon = '\0';
+            path = colon + 1;
+        } else {
+            path = output_path;
         }
+
+        test_suite_add_format(suite, format, path);
+        free(format);
     }
 
-    test_suite_set_output(suite, output);
+    free(formats);
+}
 
-    /* Format */
-    if (strcmp(format, "terminal") == 0) {
-        test_suite_set_header_printer(suite, test_print_header_terminal);
-        test_suite_set_result_printer(suite, test_print_results_terminal);
-        test_suite_set_report_function(suite, test_report_terminal);
-    } else if (strcmp(format, "json") == 0) {
-        test_suite_set_header_printer(suite, test_print_header_json);
-        test_suite_set_result_printer(suite, test_print_results_json);
-        test_suite_set_report_function(suite, test_report_json);
-    } else {
-        test_die("unknown format '%s'", format);
-    }
+void
+test_suite_add_reporter(struct test_suite *suite,
+                        const struct test_reporter *reporter) {
+    size_t nb_reporters;
+
+    nb_reporters = suite->nb_reporters + 1;
+    suite->reporters = test_realloc(suite->reporters, nb_reporters
+                                    * sizeof(struct test_reporter));
+    suite->reporters[suite->nb_reporters] = *reporter;
+    suite->nb_reporters = nb_reporters;
 }
 
 void
-test_suite_set_output(struct test_suite *suite, FILE *output) {
-    suite->output = output;
+test_suite_add_output(struct test_suite *suite, FILE *output) {
+    size_t nb_outputs;
+
+    nb_outputs = suite->nb_outputs + 1;
+    suite->outputs = test_realloc(suite->outputs,
+                                  nb_outputs * sizeof(FILE *));
+    suite->outputs[suite->nb_outputs] = output;
+    suite->nb_outputs = nb_outputs;
 }
 
 void
-test_suite_set_report_function(struct test_suite *suite,
-                               test_report_function function) {
-    suite->report_function = function;
+test_suite_set_profile_output(struct test_suite *suite, FILE *output) {
+    test_profiler_delete(suite->profiler);
+    suite->profiler = output ? test_profiler_new(output) : NULL;
 }
 
 void
-test_suite_set_header_printer(struct test_suite *suite,
-                              test_header_printer function) {
-    suite->header_printer = function;
+test_suite_set_repetitions(struct test_suite *suite, size_t nb) {
+    suite->nb_repetitions = nb;
 }
 
 void
-test_suite_set_result_printer(struct test_suite *suite,
-                              test_result_printer function) {
-    suite->result_printer = function;
+test_suite_set_until_fail(struct test_suite *suite, bool until_fail) {
+    suite->until_fail = until_fail;
+
+    /* Repeat until the first failure unless a count was set */
+    if (until_fail && suite->nb_repetitions == 1)
+        suite->nb_repetitions = 0;
+}
+
+void
+test_suite_set_repeat_duration(struct test_suite *suite, uint64_t duration) {
+    suite->repeat_duration = duration;
+
+    if (duration > 0 && suite->nb_repetitions == 1)
+        suite->nb_repetitions = 0;
+}
+
+void
+test_suite_set_jobs(struct test_suite *suite, size_t nb_jobs) {
+    suite->nb_jobs = nb_jobs;
+}
+
+void
+test_suite_set_shuffle(struct test_suite *suite, bool shuffle) {
+    suite->shuffle = shuffle;
+}
+
+void
+test_suite_set_seed(struct test_suite *suite, uint64_t seed) {
+    suite->seed = seed;
+}
+
+void
+test_suite_set_update_golden(struct test_suite *suite, bool update) {
+    suite->update_golden = update;
+}
+
+void
+test_suite_set_catch_signals(struct test_suite *suite, bool catch_signals) {
+    suite->catch_signals = catch_signals;
+}
+
+void
+test_suite_set_async_limit(struct test_suite *suite, size_t limit) {
+    suite->async_limit = limit;
+}
+
+void
+test_suite_set_progress_interval(struct test_suite *suite,
+                                 unsigned int interval) {
+    suite->progress_interval = interval;
+}
+
+void
+test_suite_set_virtual_time(struct test_suite *suite, bool virtual_time) {
+    if (virtual_time && !test_vclock_start)
+        test_die("virtual time requires linking with libutest_vtime.a");
+
+    suite->virtual_time = virtual_time;
+}
+
+void
+test_suite_set_capture_output(struct test_suite *suite, bool capture) {
+    suite->capture_output = capture;
+}
+
+void
+test_suite_set_capture_limit(struct test_suite *suite, size_t limit) {
+    suite->capture_limit = limit;
+}
+
+void
+test_suite_set_batch_size(struct test_suite *suite, size_t batch_size) {
+    test_suite_flush_records(suite);
+
+    free(suite->records);
+    suite->records = NULL;
+
+    suite->batch_size = (batch_size > 0) ? batch_size : 1;
+    if (suite->batch_size > 1) {
+        suite->records = test_malloc(suite->batch_size
+                                     * sizeof(struct test_record));
+    }
 }
 
 void
 test_suite_start(struct test_suite *suite) {
-    if (suite->header_printer)
-        suite->header_printer(suite->output, suite->name);
+    if (suite->nb_reporters == 0) {
+        struct test_reporter reporter;
+
+        reporter = test_reporter_terminal(stdout);
+        test_suite_add_reporter(suite, &reporter);
+    }
+
+    if (suite->catch_signals)
+        test_crash_install();
+
+    if (suite->capture_output && !suite->capture)
+        suite->capture = test_capture_new(suite->capture_limit);
+
+    suite->start_time = test_now();
+
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->begin_suite)
+            reporter->begin_suite(reporter->data, suite->name);
+    }
+}
+
+void
+test_suite_add_test(struct test_suite *suite, const char *test_name,
+                    test_function function) {
+    size_t nb_tests;
+
+    nb_tests = suite->nb_registered_tests + 1;
+    suite->registered_tests = test_realloc(suite->registered_tests,
+                                           nb_tests * sizeof(struct test));
+
+    suite->registered_tests[suite->nb_registered_tests].name = test_name;
+    suite->registered_tests[suite->nb_registered_tests].function = function;
+    suite->nb_registered_tests = nb_tests;
+}
+
+void
+test_suite_add_async_test(struct test_suite *suite, const char *test_name,
+                          test_function function) {
+    size_t nb_tests;
+
+    nb_tests = suite->nb_async_tests + 1;
+    suite->async_tests = test_realloc(suite->async_tests,
+                                      nb_tests * sizeof(struct test));
+
+    suite->async_tests[suite->nb_async_tests].name = test_name;
+    suite->async_tests[suite->nb_async_tests].function = function;
+    suite->nb_async_tests = nb_tests;
+}
+
+int
+test_suite_run(struct test_suite *suite) {
+    const struct test *tests;
+    size_t *order, nb_tests;
+    int ret;
+
+    tests = suite->registered_tests;
+    nb_tests = suite->nb_registered_tests;
+
+    test_suite_plan_tests(suite, nb_tests);
+
+    if (test_suite_is_repeating(suite)) {
+        suite->nb_tests += nb_tests;
+        return test_suite_repeat(suite, tests, nb_tests);
+    }
+
+    order = test_malloc((nb_tests + 1) * sizeof(size_t));
+    for (size_t i = 0; i < nb_tests; i++)
+        order[i] = i;
+
+    if (suite->shuffle) {
+        uint64_t state;
+
+        state = suite->seed;
+        test_shuffle(order, nb_tests, &state);
+    }
+
+    ret = 0;
+    for (size_t i = 0; i < nb_tests; i++) {
+        const struct test *test;
+
+        test = tests + order[i];
+        if (test_suite_run_test(suite, test->name, test->function) < 0)
+            ret = -1;
+    }
+
+    free(order);
+    return ret;
 }
 
 int
 test_suite_run_test(struct test_suite *suite, const char *test_name,
                     test_function function) {
     struct test_context ctx;
+    struct test_record record;
+    int ret;
 
     suite->nb_tests++;
 
-    memset(&ctx, 0, sizeof(struct test_context));
-    if (setjmp(ctx.before) != 0) {
-        /* Test function aborted */
+    if (test_suite_is_repeating(suite)) {
+        struct test test;
+
+        test.name = test_name;
+        test.function = function;
+
+        return test_suite_repeat(suite, &test, 1);
+    }
+
+    test_suite_begin_test(suite, test_name);
+
+    if (suite->capture)
+        test_capture_start(suite->capture);
+    ret = test_suite_execute(suite, &ctx, test_name, function, &record, true);
+
+    if (suite->capture) {
+        const char *output;
+
+        output = test_capture_stop(suite->capture);
+        if (ret == -1)
+            record.output = output;
+    }
+
+    if (ret == 0) {
+        suite->nb_passed_tests++;
+    } else {
         suite->nb_failed_tests++;
+    }
+
+    test_suite_report(suite, &record);
+    free(ctx.message);
+
+    return (record.status == TEST_STATUS_PASSED) ? 0 : -1;
+}
+
+int
+test_suite_execute(struct test_suite *suite, struct test_context *ctx,
+                   const char *test_name, test_function function,
+                   struct test_record *record, bool profile) {
+    struct test_profiler *volatile profiler;
+    uint64_t start;
+
+    memset(ctx, 0, sizeof(struct test_context));
+    ctx->test_name = test_name;
+    ctx->test_suite = suite;
+
+    memset(record, 0, sizeof(struct test_record));
+    record->test_name = test_name;
+
+    /* Read again after longjmp(), hence volatile */
+    profiler = profile ? suite->profiler : NULL;
+    if (profiler)
+        test_profiler_start(profiler);
+
+    start = test_now();
+
+    /* Saving the signal mask costs a system call; it is only needed to
+     * unblock the signal when jumping out of a crash handler */
+    if (sigsetjmp(ctx->before, suite->catch_signals) != 0) {
+        /* Test function aborted */
+        record->duration = test_now() - start;
+        if (suite->catch_signals)
+            test_crash_leave();
+        if (ctx->vclock)
+            test_vclock_stop(ctx);
+        if (profiler)
+            test_profiler_stop(profiler, test_name);
+
+        record->status = TEST_STATUS_FAILED;
+        if (ctx->signo != 0) {
+            test_crash_format(ctx);
+            record->crash = &ctx->crash;
+        }
+
+        record->file = ctx->file;
+        record->line = ctx->line;
+        record->message = test_context_message(ctx);
+
         return -1;
     }
 
-    ctx.test_name = test_name;
-    ctx.test_suite = suite;
+    if (suite->catch_signals)
+        test_crash_enter(ctx);
+    if (suite->virtual_time)
+        test_vclock_start(ctx);
+
+    function(suite, ctx);
 
-    function(suite, &ctx);
+    record->duration = test_now() - start;
+    if (suite->catch_signals)
+        test_crash_leave();
+    if (ctx->vclock)
+        test_vclock_stop(ctx);
+    if (profiler)
+        test_profiler_stop(profiler, test_name);
 
-    suite->nb_passed_tests++;
-    if (suite->report_function)
-        suite->report_function(suite->output, test_name, true, NULL, 0, NULL);
+    record->status = TEST_STATUS_PASSED;
     return 0;
 }
 
@@ -203,13 +626,30 @@ test_suite_passed(const struct test_suite *suite) {
 }
 
 void
-test_suite_print_results(const struct test_suite *suite) {
-    if (!suite->result_printer)
-        return;
-
-    suite->result_printer(suite->output,
-                          suite->nb_tests,
-                          suite->nb_passed_tests, suite->nb_failed_tests);
+test_suite_print_results(struct test_suite *suite) {
+    struct test_results results;
+
+    test_suite_flush_records(suite);
+
+    memset(&results, 0, sizeof(struct test_results));
+    results.nb_tests = suite->nb_tests;
+    results.nb_passed_tests = suite->nb_passed_tests;
+    results.nb_failed_tests = suite->nb_failed_tests;
+    results.duration = test_now() - suite->start_time;
+    results.nb_runs = suite->nb_runs;
+    results.nb_failed_runs = suite->nb_failed_runs;
+    results.shuffled = suite->shuffle;
+    results.seed = suite->seed;
+
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->end_suite)
+            reporter->end_suite(reporter->data, &results);
+        if (reporter->flush)
+            reporter->flush(reporter->data);
+    }
 }
 
 void
@@ -223,31 +663,58 @@ test_suite_print_results_and_exit(struct test_suite *suite) {
     exit(exit_code);
 }
 
+void
+test_set_location(struct test_context *ctx, const char *file, int line) {
+    ctx->file = file;
+    ctx->line = line;
+}
+
 void
 test_abort(struct test_context *ctx, const char *file, int line,
            const char *fmt, ...) {
-    struct test_suite *suite;
-    char errmsg[TEST_ERROR_BUFSZ];
     va_list ap;
+    size_t len;
+
+    va_start(ap, fmt);
+    len = (size_t)vsnprintf(ctx->errmsg, TEST_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
 
-    suite = ctx->test_suite;
+    if (len >= TEST_ERROR_BUFSZ) {
+        free(ctx->message);
+        ctx->message = test_malloc(len + 1);
 
-    if (suite->report_function) {
         va_start(ap, fmt);
-        vsnprintf(errmsg, TEST_ERROR_BUFSZ, fmt, ap);
+        vsnprintf(ctx->message, len + 1, fmt, ap);
         va_end(ap);
-
-        suite->report_function(suite->output, ctx->test_name, false,
-                               file, line, errmsg);
     }
 
-    longjmp(ctx->before, -1);
+    ctx->file = file;
+    ctx->line = line;
+
+    siglongjmp(ctx->before, -1);
+}
+
+void
+test_abort_message(struct test_context *ctx, const char *file, int line,
+                   char *message) {
+    /* The context takes ownership of the message */
+    free(ctx->message);
+    ctx->message = message;
+
+    ctx->file = file;
+    ctx->line = line;
+
+    siglongjmp(ctx->before, -1);
+}
+
+const char *
+test_context_message(const struct test_context *ctx) {
+    return ctx->message ? ctx->message : ctx->errmsg;
 }
 
 char *
 test_format_data(const char *data, size_t sz) {
-    static char buf[1024];
-
+    char buf[1024];
     char *optr;
     size_t olen;
 
@@ -300,25 +767,291 @@ test_format_data(const char *data, size_t sz) {
     }
 
     *optr = '\0';
-    return strdup(buf);
+    return test_strdup(buf);
 
 overflow:
     fprintf(stderr, "data too large for buffer\n");
     abort();
 }
 
+static void
+test_suite_add_format(struct test_suite *suite,
+                      const char *format, const char *path) {
+    struct test_reporter reporter;
+    FILE *output;
+
+    output = test_open_output(suite, path);
+
+    if (strcmp(format, "terminal") == 0) {
+        reporter = test_reporter_terminal(output);
+    } else if (strcmp(format, "progress") == 0) {
+        reporter = test_reporter_progress(output, suite->progress_interval);
+    } else if (strcmp(format, "json") == 0) {
+        reporter = test_reporter_json(output);
+    } else if (strcmp(format, "bin") == 0) {
+        reporter = test_reporter_bin(output);
+    } else {
+        test_die("unknown format '%s'", format);
+    }
+
+    test_suite_add_reporter(suite, &reporter);
+}
+
+static FILE *
+test_open_output(struct test_suite *suite, const char *path) {
+    FILE *output;
+    size_t nb_paths;
+
+    /* Two reporters writing to the same stream would interleave their
+     * output */
+    for (size_t i = 0; i < suite->nb_output_paths; i++) {
+        if (strcmp(suite->output_paths[i], path) == 0) {
+            test_die("cannot write several outputs to %s",
+                     (strcmp(path, "-") == 0) ? "stdout" : path);
+        }
+    }
+
+    nb_paths = suite->nb_output_paths + 1;
+    suite->output_paths = test_realloc(suite->output_paths,
+                                       nb_paths * sizeof(char *));
+    suite->output_paths[suite->nb_output_paths] = test_strdup(path);
+    suite->nb_output_paths = nb_paths;
+
+    if (strcmp(path, "-") == 0)
+        return stdout;
+
+    output = fopen(path, "w");
+    if (!output)
+        test_die("cannot open file %s: %s", path, strerror(errno));
+
+    test_suite_add_output(suite, output);
+    return output;
+}
+
+void
+test_suite_plan_tests(struct test_suite *suite, size_t nb_tests) {
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->plan_tests)
+            reporter->plan_tests(reporter->data, nb_tests);
+    }
+}
+
+void
+test_suite_begin_test(struct test_suite *suite, const char *test_name) {
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->begin_test)
+            reporter->begin_test(reporter->data, test_name);
+    }
+}
+
+void
+test_suite_report(struct test_suite *suite, const struct test_record *record) {
+    struct test_record *copy;
+
+    if (suite->batch_size <= 1) {
+        for (size_t i = 0; i < suite->nb_reporters; i++) {
+            struct test_reporter *reporter;
+
+            reporter = suite->reporters + i;
+            if (reporter->end_test)
+                reporter->end_test(reporter->data, record, 1);
+            if (reporter->flush)
+                reporter->flush(reporter->data);
+        }
+
+        return;
+    }
+
+    copy = suite->records + suite->nb_records++;
+    test_record_copy(copy, record);
+
+    if (suite->nb_records >= suite->batch_size)
+        test_suite_flush_records(suite);
+}
+
+static void
+test_suite_flush_records(struct test_suite *suite) {
+    if (suite->nb_records == 0)
+        return;
+
+    for (size_t i = 0; i < suite->nb_reporters; i++) {
+        struct test_reporter *reporter;
+
+        reporter = suite->reporters + i;
+        if (reporter->end_test)
+            reporter->end_test(reporter->data,
+                               suite->records, suite->nb_records);
+        if (reporter->flush)
+            reporter->flush(reporter->data);
+    }
+
+    for (size_t i = 0; i < suite->nb_records; i++)
+        test_record_free_copy(suite->records + i);
+    suite->nb_records = 0;
+}
+
+static void
+test_record_copy(struct test_record *copy, const struct test_record *record) {
+    /* The message and the details of the record live on the stack of the
+     * runner, they must be copied to outlive the test */
+    *copy = *record;
+
+    if (record->message)
+        copy->message = test_strdup(record->message);
+
+    if (record->benchmark) {
+        struct test_benchmark *benchmark;
+
+        benchmark = test_malloc(sizeof(struct test_benchmark));
+        *benchmark = *record->benchmark;
+        copy->benchmark = benchmark;
+    }
+
+    if (record->repetitions) {
+        struct test_repetitions *repetitions;
+
+        repetitions = test_malloc(sizeof(struct test_repetitions));
+        *repetitions = *record->repetitions;
+        copy->repetitions = repetitions;
+    }
+
+    if (record->output)
+        copy->output = test_strdup(record->output);
+
+    if (record->crash) {
+        struct test_crash *crash;
+
+        crash = test_malloc(sizeof(struct test_crash));
+        *crash = *record->crash;
+        crash->backtrace = test_strdup(record->crash->backtrace);
+        copy->crash = crash;
+    }
+}
+
+static void
+test_record_free_copy(struct test_record *copy) {
+    free((char *)copy->message);
+    free((struct test_benchmark *)copy->benchmark);
+    free((struct test_repetitions *)copy->repetitions);
+    free((char *)copy->output);
+
+    if (copy->crash) {
+        free((char *)copy->crash->backtrace);
+        free((struct test_crash *)copy->crash);
+    }
+}
+
+uint64_t
+test_now(void) {
+    struct timespec ts;
+
+    /* Durations are always measured in real time */
+    if (test_vclock_real_clock_gettime) {
+        test_vclock_real_clock_gettime(CLOCK_MONOTONIC, &ts);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    }
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t
+test_parse_duration(const char *string) {
+    double value;
+    char *end;
+
+    errno = 0;
+    value = strtod(string, &end);
+    if (errno != 0 || end == string || value < 0.0)
+        test_die("invalid duration '%s'", string);
+
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        value *= 1e9;
+    } else if (strcmp(end, "ms") == 0) {
+        value *= 1e6;
+    } else if (strcmp(end, "m") == 0) {
+        value *= 60e9;
+    } else if (strcmp(end, "h") == 0) {
+        value *= 3600e9;
+    } else {
+        test_die("invalid duration unit '%s'", end);
+    }
+
+    return (uint64_t)value;
+}
+
 static void
 test_usage(const char *argv0, int exit_code) {
-    printf("Usage: %s [-hfo]\n"
+    printf("Usage: %s [-bcdfhjoprsu]\n"
             "\n"
             "Options:\n"
-            "  -h            display help\n"
-            "  -f <format>   select the format used for output\n"
-            "  -o <filename> print output to a file\n"
+            "  --async-limit <n>        maximum number of async tests\n"
+            "                           running at once (default: 256)\n"
+            "  -b, --batch-size <size>  deliver test records to reporters\n"
+            "                           in batches\n"
+            "  --capture                capture the output of each test\n"
+            "                           and only show it on failure\n"
+            "  --capture-limit <bytes>  maximum size of captured output\n"
+            "                           (default: 1048576)\n"
+            "  --catch-signals          report tests killed by a signal\n"
+            "                           as failures and carry on\n"
+            "  -c, --cpu <cpu>          pin benchmarks to a cpu\n"
+            "  -d, --duration <time>    repeat tests for a duration such\n"
+            "                           as 500ms, 30s, 10m or 1h; tests\n"
+            "                           run on their own are repeated\n"
+            "                           for the whole duration each,\n"
+            "                           registered tests share it\n"
+            "  --flush-caches           flush cpu caches between\n"
+            "                           benchmark samples\n"
+            "  -h, --help               display help\n"
+            "  -j, --jobs <n>           run repetitions on n threads\n"
+            "  --noise-threshold <cv>   flag benchmarks whose coefficient\n"
+            "                           of variation is higher\n"
+            "                           (default: 0.05)\n"
+            "  -f, --format <format>    select the format used for output;\n"
+            "                           can be repeated, and\n"
+            "                           <format>:<filename> writes this\n"
+            "                           format to its own file; each\n"
+            "                           file can only hold one format\n"
+            "  -o, --output <filename>  print output to a file\n"
+            "  -p, --profile <filename> sample running tests and write\n"
+            "                           folded stacks to a file\n"
+            "  --refresh <ms>           redraw the progress line at most\n"
+            "                           every ms milliseconds\n"
+            "                           (default: 100)\n"
+            "  -r, --repeat <n>         run tests n times\n"
+            "  --samples <n>            number of samples per benchmark\n"
+            "                           (default: 30)\n"
+            "  -s, --seed <seed>        seed used to shuffle tests\n"
+            "  --shuffle                run registered tests in a random\n"
+            "                           order\n"
+            "  -u, --until-fail         repeat tests until one fails\n"
+            "  --update-golden          rewrite golden files with the\n"
+            "                           values they are compared to\n"
+            "  --virtual-time           do not wait when tests sleep\n"
+            "                           (requires libutest_vtime)\n"
+            "  --warmup <ms>            run benchmarks before measuring\n"
+            "                           them (default: 100)\n"
+            "\n"
+            "Async tests:\n"
+            "  Async tests run once each and start in the order they are\n"
+            "  added; --duration, --jobs, --profile, --repeat,\n"
+            "  --shuffle, --until-fail and --virtual-time do not apply\n"
+            "  to them.\n"
             "\n"
             "Formats:\n"
-            "  terminal      human-readable text for ansi terminals\n"
-            "  json          rfc 4627 format\n",
+            "  terminal                 human-readable text for ansi\n"
+            "                           terminals\n"
+            "  progress                 a single status line followed\n"
+            "                           by failures, on terminals\n"
+            "  json                     rfc 4627 format\n"
+            "  bin                      compact binary format read by\n"
+            "                           utest-bin\n",
             argv0);
     exit(exit_code);
 }
@@ -336,3 +1069,58 @@ test_die(const char *fmt, ...) {
     putc('\n', stderr);
     exit(1);
 }
+
+void *
+test_malloc(size_t sz) {
+    void *ptr;
+
+    ptr = malloc(sz);
+    if (!ptr) {
+        fprintf(stderr, "cannot allocate %zu bytes: %s\n",
+                sz, strerror(errno));
+        abort();
+    }
+
+    return ptr;
+}
+
+void *
+test_realloc(void *ptr, size_t sz) {
+    void *nptr;
+
+    nptr = realloc(ptr, sz);
+    if (!nptr) {
+        fprintf(stderr, "cannot reallocate %zu bytes: %s\n",
+                sz, strerror(errno));
+        abort();
+    }
+
+    return nptr;
+}
+
+char *
+test_strdup(const char *string) {
+    char *copy;
+    size_t len;
+
+    len = strlen(string);
+
+    copy = test_malloc(len + 1);
+    memcpy(copy, string, len + 1);
+
+    return copy;
+}
+
+char *
+test_strndup(const char *string, size_t max_len) {
+    char *copy;
+    size_t len;
+
+    len = strnlen(string, max_len);
+
+    copy = test_malloc(len + 1);
+    memcpy(copy, string, len);
+    copy[len] = '\0';
+
+    return copy;
+}
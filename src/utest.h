@@ -28,227 +28,712 @@ struct test_suite;
 struct test_context;
 
 typedef void (*test_function)(struct test_suite *, struct test_context *);
-typedef void (*test_report_function)(FILE *, const char *, bool,
-                                     const char *, int, const char *);
-typedef void (*test_header_printer)(FILE *, const char *);
-typedef void (*test_result_printer)(FILE *, size_t, size_t, size_t);
+
+enum test_status {
+    TEST_STATUS_PASSED,
+    TEST_STATUS_FAILED,
+};
+
+enum test_noise {
+    TEST_NOISE_VARIATION         = 0x01,
+    TEST_NOISE_FREQUENCY_SCALING = 0x02,
+    TEST_NOISE_SMT               = 0x04,
+};
+
+struct test_benchmark {
+    size_t nb_samples;
+    size_t nb_iterations; /* per sample */
+    int cpu;
+
+    /* Nanoseconds per iteration */
+    double mean;
+    double stddev;
+    double min;
+
+    double cv; /* coefficient of variation */
+    unsigned int noise; /* enum test_noise flags */
+};
+
+struct test_repetitions {
+    size_t nb_runs;
+    size_t nb_failures;
+};
+
+struct test_crash {
+    int signo;
+    const void *address;
+    const char *backtrace; /* one frame per line */
+};
+
+struct test_record {
+    const char *test_name;
+    enum test_status status;
+    uint64_t duration; /* nanoseconds */
+
+    /* Only set for failed tests */
+    const char *file;
+    int line;
+    const char *message;
+
+    /* Only set for benchmarks which passed */
+    const struct test_benchmark *benchmark;
+
+    /* Only set for repeated tests; the duration is the mean duration of a
+     * run and the message is the one of the first failure */
+    const struct test_repetitions *repetitions;
+    /* Only set for tests killed by a signal */
+    const struct test_crash *crash;
+
+    /* Only set for failed tests whose output was captured */
+    const char *output;
+};
+
+struct test_results {
+    size_t nb_tests;
+    size_t nb_passed_tests;
+    size_t nb_failed_tests;
+    uint64_t duration; /* nanoseconds */
+
+    /* Only set when tests were repeated */
+    size_t nb_runs;
+    size_t nb_failed_runs;
+
+    bool shuffled;
+    uint64_t seed;
+};
+
+/* All callbacks are optional. Records passed to end_test are only valid
+ * during the call; when the batch size of the suite is greater than 1,
+ * several records are delivered at once. plan_tests announces tests whose
+ * number is known before they run, such as registered tests. */
+struct test_reporter {
+    void (*begin_suite)(void *, const char *);
+    void (*end_suite)(void *, const struct test_results *);
+    void (*plan_tests)(void *, size_t);
+    void (*begin_test)(void *, const char *);
+    void (*end_test)(void *, const struct test_record *, size_t);
+    void (*flush)(void *);
+    void (*free_data)(void *);
+
+    void *data;
+};
 
 struct test_suite *test_suite_new(const char *);
 void test_suite_delete(struct test_suite *);
 
 void test_suite_initialize_from_args(struct test_suite *, int, char **);
 
-void test_suite_set_output(struct test_suite *, FILE *);
-void test_suite_set_report_function(struct test_suite *, test_report_function);
-void test_suite_set_header_printer(struct test_suite *, test_header_printer);
-void test_suite_set_result_printer(struct test_suite *, test_result_printer);
+void test_suite_add_reporter(struct test_suite *,
+                             const struct test_reporter *);
+void test_suite_add_output(struct test_suite *, FILE *);
+void test_suite_set_batch_size(struct test_suite *, size_t);
+void test_suite_set_profile_output(struct test_suite *, FILE *);
+
+void test_suite_set_repetitions(struct test_suite *, size_t);
+void test_suite_set_until_fail(struct test_suite *, bool);
+void test_suite_set_repeat_duration(struct test_suite *, uint64_t);
+void test_suite_set_jobs(struct test_suite *, size_t);
+void test_suite_set_shuffle(struct test_suite *, bool);
+void test_suite_set_seed(struct test_suite *, uint64_t);
+void test_suite_set_update_golden(struct test_suite *, bool);
+void test_suite_set_catch_signals(struct test_suite *, bool);
+void test_suite_set_async_limit(struct test_suite *, size_t);
+void test_suite_set_capture_output(struct test_suite *, bool);
+void test_suite_set_virtual_time(struct test_suite *, bool);
+void test_suite_set_progress_interval(struct test_suite *, unsigned int);
+void test_suite_set_capture_limit(struct test_suite *, size_t);
+
+void test_suite_set_benchmark_cpu(struct test_suite *, int);
+void test_suite_set_benchmark_samples(struct test_suite *, size_t);
+void test_suite_set_benchmark_warmup(struct test_suite *, uint64_t);
+void test_suite_set_benchmark_flush_caches(struct test_suite *, bool);
+void test_suite_set_benchmark_noise_threshold(struct test_suite *, double);
 
 void test_suite_start(struct test_suite *);
+
+/* Registered tests are run as a set by test_suite_run(): they are shuffled
+ * with --shuffle and share the --duration. test_suite_run_test() runs a
+ * single test right away, in call order, and repeats it for the whole
+ * --duration. */
+void test_suite_add_test(struct test_suite *, const char *, test_function);
+int test_suite_run(struct test_suite *);
+
+/* Async tests run once each and start in the order they were added;
+ * repetition, shuffling, virtual time and profiling do not apply to them. */
+void test_suite_add_async_test(struct test_suite *, const char *,
+                               test_function);
+int test_suite_run_async(struct test_suite *);
 int test_suite_run_test(struct test_suite *, const char *, test_function);
+int test_suite_run_benchmark(struct test_suite *, const char *,
+                             test_function);
 bool test_suite_passed(const struct test_suite *);
-void test_suite_print_results(const struct test_suite *);
+void test_suite_print_results(struct test_suite *);
 void test_suite_print_results_and_exit(struct test_suite *)
     __attribute__((noreturn));
 
-void test_report_terminal(FILE *, const char *, bool,
-                          const char *, int, const char *);
-void test_print_header_terminal(FILE *, const char *);
-void test_print_results_terminal(FILE *, size_t, size_t, size_t);
+struct test_reporter test_reporter_terminal(FILE *);
+struct test_reporter test_reporter_progress(FILE *, unsigned int);
+struct test_reporter test_reporter_json(FILE *);
+struct test_reporter test_reporter_bin(FILE *);
+
+/* Binary results files. Records and the name index point into an interned
+ * string table; offset 0 is always the empty string. */
+struct test_bin_record {
+    uint32_t test_name;
+    uint32_t file;
+    uint32_t message;
+    int32_t line;
+    uint64_t duration; /* nanoseconds */
+    uint32_t status;
+    uint32_t padding;
+};
+
+struct test_bin;
+
+struct test_bin *test_bin_open(const char *);
+void test_bin_close(struct test_bin *);
+
+const char *test_bin_suite_name(const struct test_bin *);
+void test_bin_results(const struct test_bin *, struct test_results *);
+size_t test_bin_nb_records(const struct test_bin *);
+const struct test_bin_record *test_bin_record(const struct test_bin *, size_t);
+const struct test_bin_record *test_bin_sorted_record(const struct test_bin *,
+                                                     size_t);
+const struct test_bin_record *test_bin_find(const struct test_bin *,
+                                            const char *);
+const char *test_bin_string(const struct test_bin *, uint32_t);
 
-void test_report_json(FILE *, const char *, bool,
-                      const char *, int, const char *);
-void test_print_header_json(FILE *, const char *);
-void test_print_results_json(FILE *, size_t, size_t, size_t);
+const char *test_noise_string(unsigned int);
 
+void test_set_location(struct test_context *, const char *, int);
 void test_abort(struct test_context *, const char *, int, const char *, ...)
-    __attribute__((format(printf, 4, 5)));
+    __attribute__((format(printf, 4, 5), noreturn));
 
 char *test_format_data(const char *, size_t);
 
+/* Failure paths of assertion macros. They are kept out of line so that an
+ * assertion only costs a comparison and a branch at the call site. */
+#define TEST_FAILURE __attribute__((cold, noinline, noreturn))
+
+void test_fail_true(struct test_context *, const char *, int,
+                    const char *) TEST_FAILURE;
+void test_fail_false(struct test_context *, const char *, int,
+                     const char *) TEST_FAILURE;
+void test_fail_int_eq(struct test_context *, const char *, int,
+                      const char *, intmax_t, intmax_t) TEST_FAILURE;
+void test_fail_uint_eq(struct test_context *, const char *, int,
+                       const char *, uintmax_t, uintmax_t) TEST_FAILURE;
+void test_fail_float_eq(struct test_context *, const char *, int,
+                        const char *, float, float) TEST_FAILURE;
+void test_fail_double_eq(struct test_context *, const char *, int,
+                         const char *, double, double) TEST_FAILURE;
+void test_fail_ldouble_eq(struct test_context *, const char *, int,
+                          const char *, long double,
+                          long double) TEST_FAILURE;
+void test_fail_bool_eq(struct test_context *, const char *, int,
+                       const char *, bool, bool) TEST_FAILURE;
+void test_fail_string_eq(struct test_context *, const char *, int,
+                         const char *, const char *,
+                         const char *) TEST_FAILURE;
+void test_fail_mem_eq(struct test_context *, const char *, int,
+                      const char *, const void *, size_t,
+                      const void *, size_t) TEST_FAILURE;
+void test_fail_ptr_eq(struct test_context *, const char *, int,
+                      const char *, const void *, const void *) TEST_FAILURE;
+void test_fail_ptr_null(struct test_context *, const char *, int,
+                        const char *) TEST_FAILURE;
+void test_fail_ptr_not_null(struct test_context *, const char *, int,
+                            const char *) TEST_FAILURE;
+
+enum test_tolerance {
+    TEST_TOLERANCE_ABSOLUTE,
+    TEST_TOLERANCE_RELATIVE,
+    TEST_TOLERANCE_ULP,
+};
+
+const char *test_tolerance_string(enum test_tolerance);
+
+size_t test_float_array_count_far(const float *, const float *, size_t,
+                                  enum test_tolerance, double);
+size_t test_double_array_count_far(const double *, const double *, size_t,
+                                   enum test_tolerance, double);
+
+void test_fail_float_array_near(struct test_context *, const char *, int,
+                                const char *, const float *, const float *,
+                                size_t, enum test_tolerance,
+                                double) TEST_FAILURE;
+void test_fail_double_array_near(struct test_context *, const char *, int,
+                                 const char *, const double *,
+                                 const double *, size_t, enum test_tolerance,
+                                 double) TEST_FAILURE;
+
+void test_check_file_eq(struct test_context *, const char *, int,
+                        const char *, const void *, size_t, const char *);
+
+/* Async tests */
+enum test_wait_event {
+    TEST_READABLE = 0x01,
+    TEST_WRITABLE = 0x02,
+};
+
+uint32_t test_wait_fd(struct test_context *, const char *, int,
+                      int, uint32_t, int);
+void test_sleep(struct test_context *, unsigned int);
+
+/* Virtual time */
+void test_enable_virtual_time(struct test_context *);
+
+/* Linearizability */
+struct test_history;
+struct test_history_recorder;
+
+struct test_history_op {
+    unsigned int thread;
+    int function;
+    intptr_t argument;
+    intptr_t result;
+    uint64_t invoke_time;   /* nanoseconds */
+    uint64_t response_time; /* nanoseconds, 0 while pending */
+};
+
+/* A sequential specification of the structure being tested. step()
+ * applies an operation to the state, which is state_size bytes long, and
+ * returns false if the result of the operation is not the one of the
+ * model; the state is restored by the checker in this case. The result of
+ * a pending operation (response_time 0) is unknown and must not be
+ * checked. */
+struct test_model {
+    size_t state_size;
+
+    void (*init)(void *);
+    bool (*step)(void *, const struct test_history_op *);
+
+    /* Optional */
+    void (*format)(char *, size_t, const struct test_history_op *);
+};
+
+struct test_history *test_history_new(size_t, size_t);
+void test_history_delete(struct test_history *);
+
+struct test_history_recorder *test_history_recorder(struct test_history *,
+                                                    size_t);
+size_t test_history_invoke(struct test_history_recorder *, int, intptr_t);
+void test_history_respond(struct test_history_recorder *, size_t, intptr_t);
+
+void test_check_linearizable(struct test_context *, const char *, int,
+                             const char *, const struct test_history *,
+                             const struct test_model *);
+
+static inline bool
+test_string_equal(const char *value, const char *expected) {
+    if (value && expected)
+        return strcmp(value, expected) == 0;
+
+    return value == expected;
+}
+
+static inline bool
+test_mem_equal(const void *value, size_t value_sz,
+               const void *expected, size_t expected_sz) {
+    if (value && expected) {
+        return value_sz == expected_sz
+            && memcmp(value, expected, value_sz) == 0;
+    }
+
+    return value == expected;
+}
+
 #define TEST_FUNCTION_NAME(name_) \
     test_case_##name_
 
+#define TEST_BODY_NAME(name_) \
+    test_case_body_##name_
+
+/* The test function records where the test is defined, so that crashes,
+ * which have no source location, are reported there. TEST() always defines
+ * the test; use TEST_DECLARE() to declare a test defined further down. */
 #define TEST(name_) \
+    static inline void TEST_BODY_NAME(name_)(struct test_suite *, \
+                                             struct test_context *); \
     static void TEST_FUNCTION_NAME(name_)(struct test_suite *test_suite, \
-                                          struct test_context *test_context)
+                                          struct test_context *test_context) { \
+        test_set_location(test_context, __FILE__, __LINE__); \
+        TEST_BODY_NAME(name_)(test_suite, test_context); \
+    } \
+    static inline void TEST_BODY_NAME(name_)(struct test_suite *test_suite, \
+                                             struct test_context *test_context)
+
+#define TEST_DECLARE(name_) \
+    static void TEST_FUNCTION_NAME(name_)(struct test_suite *, \
+                                          struct test_context *)
 
 #define TEST_RUN(test_suite_, test_name_) \
     test_suite_run_test(test_suite_, #test_name_, \
                         TEST_FUNCTION_NAME(test_name_))
 
+#define TEST_ADD(test_suite_, test_name_) \
+    test_suite_add_test(test_suite_, #test_name_, \
+                        TEST_FUNCTION_NAME(test_name_))
+
+#define TEST_ADD_ASYNC(test_suite_, test_name_) \
+    test_suite_add_async_test(test_suite_, #test_name_, \
+                              TEST_FUNCTION_NAME(test_name_))
+
+#define TEST_BENCHMARK_RUN(test_suite_, test_name_) \
+    test_suite_run_benchmark(test_suite_, #test_name_, \
+                             TEST_FUNCTION_NAME(test_name_))
+
 #define TEST_ABORT(fmt_, ...) \
     test_abort(test_context, __FILE__, __LINE__, fmt_, ##__VA_ARGS__)
 
-#define TEST_TRUE(value_)                                 \
-    do {                                                  \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (!(value_))                                    \
-            TEST_ABORT("%s is not true", value_str_);     \
+#define TEST_UNLIKELY(expr_) __builtin_expect(!!(expr_), 0)
+
+#define TEST_TRUE(value_)                                           \
+    do {                                                            \
+        if (TEST_UNLIKELY(!(value_)))                               \
+            test_fail_true(test_context, __FILE__, __LINE__,        \
+                           #value_);                                \
+    } while(0)
+
+#define TEST_FALSE(value_)                                          \
+    do {                                                            \
+        if (TEST_UNLIKELY(value_))                                  \
+            test_fail_false(test_context, __FILE__, __LINE__,       \
+                            #value_);                               \
+    } while(0)
+
+#define TEST_INT_EQ(value_, expected_)                              \
+    do {                                                            \
+        int64_t value__ = value_;                                   \
+        int64_t expected__ = expected_;                             \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_int_eq(test_context, __FILE__, __LINE__,      \
+                             #value_, value__, expected__);         \
+        }                                                           \
     } while(0)
 
-#define TEST_FALSE(value_)                                \
-    do {                                                  \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value_)                                       \
-            TEST_ABORT("%s is not false", value_str_);    \
+#define TEST_UINT_EQ(value_, expected_)                             \
+    do {                                                            \
+        uint64_t value__ = value_;                                  \
+        uint64_t expected__ = expected_;                            \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_uint_eq(test_context, __FILE__, __LINE__,     \
+                              #value_, value__, expected__);        \
+        }                                                           \
     } while(0)
 
-#define TEST_INT_EQ(value_, expected_)                    \
-    do {                                                  \
-        int64_t value__ = value_;                         \
-        int64_t expected__ = expected_;                   \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value__ != expected__) {                      \
-            TEST_ABORT("%s is equal to %"PRIi64" "        \
-                       "but should be equal to %"PRIi64,  \
-                       value_str_, value__, expected__);  \
-        }                                                 \
+#define TEST_FLOAT_EQ(value_, expected_)                            \
+    do {                                                            \
+        float value__ = value_;                                     \
+        float expected__ = expected_;                               \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_float_eq(test_context, __FILE__, __LINE__,    \
+                               #value_, value__, expected__);       \
+        }                                                           \
     } while(0)
 
-#define TEST_UINT_EQ(value_, expected_)                   \
-    do {                                                  \
-        uint64_t value__ = value_;                        \
-        uint64_t expected__ = expected_;                  \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value__ != expected__) {                      \
-            TEST_ABORT("%s is equal to %"PRIu64" "        \
-                       "but should be equal to %"PRIu64,  \
-                       value_str_, value__, expected__);  \
-        }                                                 \
+#define TEST_DOUBLE_EQ(value_, expected_)                           \
+    do {                                                            \
+        double value__ = value_;                                    \
+        double expected__ = expected_;                              \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_double_eq(test_context, __FILE__, __LINE__,   \
+                                #value_, value__, expected__);      \
+        }                                                           \
     } while(0)
 
-#define TEST_FLOAT_EQ(value_, expected_)                  \
-    do {                                                  \
-        float value__ = value_;                           \
-        float expected__ = expected_;                     \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value__ != expected__) {                      \
-            TEST_ABORT("%s is equal to %.9g "             \
-                       "but should be equal to %.9g",     \
-                       value_str_, value__, expected__);  \
-        }                                                 \
+#define TEST_BOOL_EQ(value_, expected_)                             \
+    do {                                                            \
+        bool value__ = value_;                                      \
+        bool expected__ = expected_;                                \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_bool_eq(test_context, __FILE__, __LINE__,     \
+                              #value_, value__, expected__);        \
+        }                                                           \
     } while(0)
 
-#define TEST_DOUBLE_EQ(value_, expected_)                 \
-    do {                                                  \
-        double value__ = value_;                          \
-        double expected__ = expected_;                    \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value__ != expected__) {                      \
-            TEST_ABORT("%s is equal to %.17g "            \
-                       "but should be equal to %.17g",    \
-                       value_str_, value__, expected__);  \
-        }                                                 \
+#define TEST_STRING_EQ(value_, expected_)                           \
+    do {                                                            \
+        const char *value__ = value_;                               \
+        const char *expected__ = expected_;                         \
+                                                                    \
+        if (TEST_UNLIKELY(!test_string_equal(value__, expected__))) { \
+            test_fail_string_eq(test_context, __FILE__, __LINE__,   \
+                                #value_, value__, expected__);      \
+        }                                                           \
     } while(0)
 
-#define TEST_BOOL_EQ(value_, expected_)                   \
-    do {                                                  \
-        bool value__ = value_;                            \
-        bool expected__ = expected_;                      \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value__ != expected__) {                      \
-            TEST_ABORT("%s is %s but should be %s",       \
-                       value_str_,                        \
-                       (value__ ? "true" : "false"),      \
-                       (expected__ ? "true" : "false"));  \
-        }                                                 \
+#define TEST_MEM_EQ(value_, value_sz_, expected_, expected_sz_)     \
+    do {                                                            \
+        const char *value__ = (const char *)(value_);               \
+        size_t value_sz__ = value_sz_;                              \
+        const char *expected__ = (const char *)(expected_);         \
+        size_t expected_sz__ = expected_sz_;                        \
+                                                                    \
+        if (TEST_UNLIKELY(!test_mem_equal(value__, value_sz__,      \
+                                          expected__,               \
+                                          expected_sz__))) {        \
+            test_fail_mem_eq(test_context, __FILE__, __LINE__,      \
+                             #value_, value__, value_sz__,          \
+                             expected__, expected_sz__);            \
+        }                                                           \
     } while(0)
 
-#define TEST_STRING_EQ(value_, expected_)                            \
-    do {                                                             \
-        const char *value__ = value_;                                \
-        const char *expected__ = expected_;                          \
-        const char *value_str_ = #value_;                            \
-                                                                     \
-        if (value__ && expected__) {                                 \
-            if (strcmp(value__, expected__) != 0) {                  \
-                TEST_ABORT("%s is the string \"%s\" "                \
-                           "but should be the string \"%s\"",        \
-                           value_str_, value__, expected__);         \
-            }                                                        \
-        } else if (expected__) {                                     \
-            TEST_ABORT("%s is null but should be the string \"%s\"", \
-                       value_str_, expected__);                      \
-        } else if (value__) {                                        \
-            TEST_ABORT("%s is the string \"%s\" but should be null", \
-                       value_str_, value__);                         \
-        }                                                            \
+/* Compare arrays element by element. The tolerance is a maximum absolute
+ * error, a maximum relative error or a maximum number of units in the last
+ * place depending on the mode; NaN never matches. */
+#define TEST_FLOAT_ARRAY_NEAR(values_, expected_, n_, mode_, tolerance_)   \
+    do {                                                                  \
+        const float *values__ = values_;                                  \
+        const float *expected__ = expected_;                              \
+        size_t n__ = n_;                                                  \
+        enum test_tolerance mode__ = mode_;                               \
+        double tolerance__ = tolerance_;                                  \
+                                                                          \
+        if (TEST_UNLIKELY(test_float_array_count_far(values__, expected__, \
+                                                     n__, mode__,         \
+                                                     tolerance__) > 0)) { \
+            test_fail_float_array_near(test_context, __FILE__, __LINE__,  \
+                                       #values_, values__, expected__,    \
+                                       n__, mode__, tolerance__);         \
+        }                                                                 \
     } while(0)
 
-#define TEST_MEM_EQ(value_, value_sz_, expected_, expected_sz_)          \
-    do {                                                                 \
-        const char *value__ = (const char *)(value_);              \
-        size_t value_sz__ = value_sz_;                                   \
-        const char *expected__ = (const char *)(expected_);        \
-        size_t expected_sz__ = expected_sz_;                             \
-        const char *value_str_ = #value_;                                \
-                                                                         \
-        if (value__ && expected__) {                                     \
-            if (value_sz__ != expected_sz__) {                           \
-                TEST_ABORT("%s is %zu bytes long but should be "         \
-                           "%zu bytes long",                             \
-                           value_str_, value_sz__, expected_sz__);       \
-            }                                                            \
-            if (memcmp(value__, expected__, value_sz__) != 0) {          \
-                TEST_ABORT("%s contains \"%s\" "                         \
-                           "but should contain \"%s\"",                  \
-                           value_str_,                                   \
-                           test_format_data(value__, value_sz__),        \
-                           test_format_data(expected__, expected_sz__)); \
-            }                                                            \
-        } else if (expected__) {                                         \
-            TEST_ABORT("%s is null but should be the string \"%s\"",     \
-                       value_str_,                                       \
-                       test_format_data(expected__, expected_sz__));     \
-        } else if (value__) {                                            \
-            TEST_ABORT("%s is the string \"%s\" but should be null",     \
-                       value_str_,                                       \
-                       test_format_data(value__, value_sz__));           \
-        }                                                                \
+#define TEST_DOUBLE_ARRAY_NEAR(values_, expected_, n_, mode_, tolerance_)  \
+    do {                                                                  \
+        const double *values__ = values_;                                 \
+        const double *expected__ = expected_;                             \
+        size_t n__ = n_;                                                  \
+        enum test_tolerance mode__ = mode_;                               \
+        double tolerance__ = tolerance_;                                  \
+                                                                          \
+        if (TEST_UNLIKELY(test_double_array_count_far(values__,           \
+                                                      expected__, n__,    \
+                                                      mode__,             \
+                                                      tolerance__) > 0)) { \
+            test_fail_double_array_near(test_context, __FILE__, __LINE__, \
+                                        #values_, values__, expected__,   \
+                                        n__, mode__, tolerance__);        \
+        }                                                                 \
     } while(0)
 
-#define TEST_PTR_EQ(value_, expected_)                         \
-    do {                                                       \
-        const void *value__ = value_;                          \
-        const void *expected__ = expected_;                    \
-        const char *value_str_ = #value_;                      \
-                                                               \
-        if (value__ && expected__) {                           \
-            if (value__ != expected__) {                       \
-                TEST_ABORT("%s is equal to %p "                \
-                           "but should be equal to %p",        \
-                           value_str_, value__, expected__);   \
-            }                                                  \
-        } else if (expected__) {                               \
-            TEST_ABORT("%s is null but should be equal to %p", \
-                       value_str_, expected__);                \
-        } else if (value__) {                                  \
-            TEST_ABORT("%s is equal to %p but should be null", \
-                       value_str_, value__);                   \
-        }                                                      \
+/* Compare a buffer to the content of a golden file, or replace the file
+ * with the buffer when the suite runs with --update-golden. Relative paths
+ * are resolved from the current directory, not from the source file. */
+#define TEST_FILE_EQ(value_, value_sz_, path_)                      \
+    test_check_file_eq(test_context, __FILE__, __LINE__, #value_,   \
+                       value_, value_sz_, path_)
+
+/* In async tests, waiting lets other tests run; in other tests, it simply
+ * blocks. The timeout is in milliseconds, -1 meaning none, and the ready
+ * events are returned, 0 meaning that the timeout expired. */
+#define TEST_WAIT_FD(fd_, events_, timeout_)                        \
+    test_wait_fd(test_context, __FILE__, __LINE__,                  \
+                 fd_, events_, timeout_)
+
+#define TEST_WAIT_READABLE(fd_, timeout_) \
+    TEST_WAIT_FD(fd_, TEST_READABLE, timeout_)
+
+#define TEST_WAIT_WRITABLE(fd_, timeout_) \
+    TEST_WAIT_FD(fd_, TEST_WRITABLE, timeout_)
+
+#define TEST_SLEEP(ms_) \
+    test_sleep(test_context, ms_)
+
+/* Until the end of the test, sleeping and waiting for poll() timeouts do
+ * not take any time once all threads of the test are blocked: the clock
+ * of the test jumps forward instead. clock_gettime(), gettimeofday() and
+ * time() read the clock of the test; other tests running at the same time
+ * keep their own clock. pthread_cond_timedwait(), select(), ppoll() and
+ * epoll_wait() are not virtual and wait in real time.
+ *
+ * Virtual time interposes functions of the C library and is only
+ * available in programs linked with -lutest_vtime, after -lutest. */
+#define TEST_VIRTUAL_TIME() \
+    test_enable_virtual_time(test_context)
+
+/* Check that the operations recorded in a history can be ordered in a way
+ * which respects real time and the model; on failure, report the end of
+ * the shortest prefix in time of the history which cannot, operations
+ * running at the end of the prefix being pending. */
+#define TEST_LINEARIZABLE(history_, model_)                         \
+    test_check_linearizable(test_context, __FILE__, __LINE__,       \
+                            #history_, history_, model_)
+
+#define TEST_PTR_EQ(value_, expected_)                              \
+    do {                                                            \
+        const void *value__ = value_;                               \
+        const void *expected__ = expected_;                         \
+                                                                    \
+        if (TEST_UNLIKELY(value__ != expected__)) {                 \
+            test_fail_ptr_eq(test_context, __FILE__, __LINE__,      \
+                             #value_, value__, expected__);         \
+        }                                                           \
     } while(0)
 
-#define TEST_PTR_NULL(value_)                             \
-    do {                                                  \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (value_)                                       \
-            TEST_ABORT("%s is not null", value_str_);     \
+#define TEST_PTR_NULL(value_)                                       \
+    do {                                                            \
+        if (TEST_UNLIKELY((value_) != NULL))                        \
+            test_fail_ptr_null(test_context, __FILE__, __LINE__,    \
+                               #value_);                            \
     } while(0)
 
-#define TEST_PTR_NOT_NULL(value_)                         \
-    do {                                                  \
-        const char *value_str_ = #value_;                 \
-                                                          \
-        if (!value_)                                      \
-            TEST_ABORT("%s is null", value_str_);         \
+#define TEST_PTR_NOT_NULL(value_)                                   \
+    do {                                                            \
+        if (TEST_UNLIKELY((value_) == NULL))                        \
+            test_fail_ptr_not_null(test_context, __FILE__, __LINE__, \
+                                   #value_);                        \
     } while(0)
 
+/* Compare values according to the types of both of them. Integers are
+ * compared by value, whatever their size and signedness; as soon as one of
+ * the values is a floating point number, both are compared in their common
+ * floating point type. char pointers are compared as strings; other
+ * pointers are compared by address. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+
+#define TEST_EQ(value_, expected_)                                  \
+    _Generic(TEST_ARITHMETIC(value_) + TEST_ARITHMETIC(expected_),  \
+             float: test_eq_float,                                  \
+             double: test_eq_double,                                \
+             long double: test_eq_ldouble,                          \
+             default: _Generic((value_),                            \
+                               bool: TEST_EQ_BOOL(expected_),       \
+                               char: TEST_EQ_INT(expected_),        \
+                               signed char: TEST_EQ_INT(expected_), \
+                               unsigned char: TEST_EQ_UINT(expected_), \
+                               short: TEST_EQ_INT(expected_),       \
+                               unsigned short: TEST_EQ_UINT(expected_), \
+                               int: TEST_EQ_INT(expected_),         \
+                               unsigned int: TEST_EQ_UINT(expected_), \
+                               long: TEST_EQ_INT(expected_),        \
+                               unsigned long: TEST_EQ_UINT(expected_), \
+                               long long: TEST_EQ_INT(expected_),   \
+                               unsigned long long: TEST_EQ_UINT(expected_), \
+                               char *: test_eq_string,              \
+                               const char *: test_eq_string,        \
+                               default: test_eq_ptr))               \
+        (test_context, __FILE__, __LINE__, #value_, value_, expected_)
+
+/* The value itself for arithmetic types, 0 for pointers, so that the type
+ * of the sum of two values is their common type */
+#define TEST_ARITHMETIC(value_)                                     \
+    _Generic((value_),                                              \
+             bool: (value_),                                        \
+             char: (value_),                                        \
+             signed char: (value_),                                 \
+             unsigned char: (value_),                               \
+             short: (value_),                                       \
+             unsigned short: (value_),                              \
+             int: (value_),                                         \
+             unsigned int: (value_),                                \
+             long: (value_),                                        \
+             unsigned long: (value_),                               \
+             long long: (value_),                                   \
+             unsigned long long: (value_),                          \
+             float: (value_),                                       \
+             double: (value_),                                      \
+             long double: (value_),                                 \
+             default: 0)
+
+#define TEST_EQ_BOOL(expected_)                                     \
+    _Generic((expected_),                                           \
+             bool: test_eq_bool,                                    \
+             unsigned char: test_eq_uint,                           \
+             unsigned short: test_eq_uint,                          \
+             unsigned int: test_eq_uint,                            \
+             unsigned long: test_eq_uint,                           \
+             unsigned long long: test_eq_uint,                      \
+             default: test_eq_bool_int)
+
+#define TEST_EQ_INT(expected_)                                      \
+    _Generic((expected_),                                           \
+             bool: test_eq_int_uint,                                \
+             unsigned char: test_eq_int_uint,                       \
+             unsigned short: test_eq_int_uint,                      \
+             unsigned int: test_eq_int_uint,                        \
+             unsigned long: test_eq_int_uint,                       \
+             unsigned long long: test_eq_int_uint,                  \
+             default: test_eq_int)
+
+#define TEST_EQ_UINT(expected_)                                     \
+    _Generic((expected_),                                           \
+             bool: test_eq_uint,                                    \
+             unsigned char: test_eq_uint,                           \
+             unsigned short: test_eq_uint,                          \
+             unsigned int: test_eq_uint,                            \
+             unsigned long: test_eq_uint,                           \
+             unsigned long long: test_eq_uint,                      \
+             default: test_eq_uint_int)
+
+#endif
+
+#define TEST_DEFINE_EQ(name_, type_, fail_)                              \
+    static inline void                                                   \
+    test_eq_##name_(struct test_context *ctx, const char *file, int line, \
+                    const char *expr, type_ value, type_ expected) {     \
+        if (TEST_UNLIKELY(value != expected))                            \
+            fail_(ctx, file, line, expr, value, expected);               \
+    }
+
+TEST_DEFINE_EQ(bool, bool, test_fail_bool_eq)
+TEST_DEFINE_EQ(int, intmax_t, test_fail_int_eq)
+TEST_DEFINE_EQ(uint, uintmax_t, test_fail_uint_eq)
+TEST_DEFINE_EQ(float, float, test_fail_float_eq)
+TEST_DEFINE_EQ(double, double, test_fail_double_eq)
+TEST_DEFINE_EQ(ldouble, long double, test_fail_ldouble_eq)
+TEST_DEFINE_EQ(ptr, const void *, test_fail_ptr_eq)
+
+static inline void
+test_eq_bool_int(struct test_context *ctx, const char *file, int line,
+                 const char *expr, bool value, intmax_t expected) {
+    if (TEST_UNLIKELY((intmax_t)value != expected)) {
+        if (expected == 0 || expected == 1) {
+            test_fail_bool_eq(ctx, file, line, expr, value, expected);
+        } else {
+            test_fail_int_eq(ctx, file, line, expr, value, expected);
+        }
+    }
+}
+
+static inline void
+test_eq_int_uint(struct test_context *ctx, const char *file, int line,
+                 const char *expr, intmax_t value, uintmax_t expected) {
+    if (TEST_UNLIKELY(value < 0 || (uintmax_t)value != expected)) {
+        if (expected <= INTMAX_MAX) {
+            test_fail_int_eq(ctx, file, line, expr, value,
+                             (intmax_t)expected);
+        } else {
+            test_fail_uint_eq(ctx, file, line, expr, (uintmax_t)value,
+                              expected);
+        }
+    }
+}
+
+static inline void
+test_eq_uint_int(struct test_context *ctx, const char *file, int line,
+                 const char *expr, uintmax_t value, intmax_t expected) {
+    if (TEST_UNLIKELY(expected < 0 || value != (uintmax_t)expected)) {
+        if (expected < 0 && value <= INTMAX_MAX) {
+            test_fail_int_eq(ctx, file, line, expr, (intmax_t)value,
+                             expected);
+        } else {
+            test_fail_uint_eq(ctx, file, line, expr, value,
+                              (uintmax_t)expected);
+        }
+    }
+}
+
+static inline void
+test_eq_string(struct test_context *ctx, const char *file, int line,
+               const char *expr, const char *value, const char *expected) {
+    if (TEST_UNLIKELY(!test_string_equal(value, expected)))
+        test_fail_string_eq(ctx, file, line, expr, value, expected);
+}
+
 #endif
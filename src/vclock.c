@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/time.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Virtual time is built in libutest_vtime.a, which interposes the time
+ * functions of the C library; libutest.a only refers to it through weak
+ * symbols, so that programs which do not link it keep the real functions.
+ *
+ * Each test which enables virtual time gets its own clock, which is real
+ * time plus an offset. The threads of the clock are the thread running the
+ * test and the threads it creates while the clock is enabled; other
+ * threads, e.g. the ones of the framework or of other tests running at the
+ * same time, are not affected. For these threads, sleeping functions and
+ * poll() timeouts are handled here: when every thread of the clock is
+ * blocked, either waiting for time or for another thread of the clock, the
+ * offset jumps so that the earliest deadline is reached at once.
+ *
+ * Threads blocked on anything else than time, pthread_join() or
+ * pthread_cond_wait() are considered running, and time then flows at its
+ * normal pace. This includes pthread_cond_timedwait(), select(), ppoll()
+ * and epoll_wait(), which wait in real time. */
+
+/* How long, in real time, nothing must happen before time jumps; it gives
+ * threads which have just been woken up the time to be counted as
+ * running again. */
+#define TEST_VCLOCK_GRACE 100000 /* nanoseconds */
+
+struct test_vclock_sleeper {
+    uint64_t deadline; /* virtual monotonic time */
+    struct test_vclock_sleeper *next;
+};
+
+struct test_vclock {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Cleared at the end of the test; threads which outlive it stop
+     * taking part in virtual time */
+    atomic_bool enabled;
+    atomic_uint_fast64_t offset;
+
+    size_t nb_threads;
+    size_t nb_blocked;
+    uint64_t generation;
+
+    struct test_vclock_sleeper *sleepers;
+
+    /* One reference for the test and one for each thread created */
+    atomic_size_t nb_refs;
+};
+
+struct test_vclock_thread {
+    void *(*start)(void *);
+    void *arg;
+    struct test_vclock *vclock;
+};
+
+/* Clock of the thread, NULL if none */
+static _Thread_local struct test_vclock *test_vclock_current;
+
+static pthread_once_t test_vclock_once = PTHREAD_ONCE_INIT;
+
+static int (*test_real_clock_gettime)(clockid_t, struct timespec *);
+static int (*test_real_gettimeofday)(struct timeval *, void *);
+static int (*test_real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*test_real_clock_nanosleep)(clockid_t, int,
+                                        const struct timespec *,
+                                        struct timespec *);
+static int (*test_real_poll)(struct pollfd *, nfds_t, int);
+static int (*test_real_pthread_create)(pthread_t *, const pthread_attr_t *,
+                                       void *(*)(void *), void *);
+static int (*test_real_pthread_join)(pthread_t, void **);
+static int (*test_real_pthread_cond_wait)(pthread_cond_t *,
+                                          pthread_mutex_t *);
+static int (*test_real_pthread_cond_timedwait)(pthread_cond_t *,
+                                               pthread_mutex_t *,
+                                               const struct timespec *);
+
+static void test_vclock_init(void);
+static void *test_vclock_symbol(const char *);
+static struct test_vclock *test_vclock_self(void);
+static void test_vclock_release(struct test_vclock *);
+static bool test_vclock_is_virtual(clockid_t);
+static uint64_t test_vclock_real_now(void);
+static uint64_t test_vclock_now(struct test_vclock *);
+static void test_vclock_block(struct test_vclock *);
+static void test_vclock_unblock(struct test_vclock *);
+static void test_vclock_sleep_until(struct test_vclock *, uint64_t,
+                                    struct pollfd *, nfds_t, int *);
+static void test_vclock_signal(struct test_vclock *);
+static void *test_vclock_thread_main(void *);
+static void test_vclock_thread_exit(void *);
+
+void
+test_enable_virtual_time(struct test_context *ctx) {
+    if (!ctx->vclock)
+        test_vclock_start(ctx);
+}
+
+void
+test_vclock_start(struct test_context *ctx) {
+    struct test_vclock *vclock;
+    pthread_condattr_t attr;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_malloc(sizeof(struct test_vclock));
+    memset(vclock, 0, sizeof(struct test_vclock));
+
+    pthread_mutex_init(&vclock->mutex, NULL);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vclock->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    atomic_init(&vclock->enabled, true);
+    atomic_init(&vclock->offset, 0);
+    atomic_init(&vclock->nb_refs, 1);
+
+    vclock->nb_threads = 1;
+
+    ctx->vclock = vclock;
+    test_vclock_current = vclock;
+}
+
+void
+test_vclock_stop(struct test_context *ctx) {
+    struct test_vclock *vclock;
+
+    vclock = ctx->vclock;
+
+    pthread_mutex_lock(&vclock->mutex);
+    atomic_store(&vclock->enabled, false);
+    pthread_cond_broadcast(&vclock->cond);
+    pthread_mutex_unlock(&vclock->mutex);
+
+    test_vclock_current = NULL;
+    ctx->vclock = NULL;
+
+    test_vclock_release(vclock);
+}
+
+int
+test_vclock_real_clock_gettime(clockid_t clock, struct timespec *ts) {
+    pthread_once(&test_vclock_once, test_vclock_init);
+    return test_real_clock_gettime(clock, ts);
+}
+
+int
+clock_gettime(clockid_t clock, struct timespec *ts) {
+    struct test_vclock *vclock;
+    uint64_t offset;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    ret = test_real_clock_gettime(clock, ts);
+    if (ret == -1 || !test_vclock_is_virtual(clock))
+        return ret;
+
+    vclock = test_vclock_self();
+    if (!vclock)
+        return ret;
+
+    offset = atomic_load(&vclock->offset);
+    offset += (uint64_t)ts->tv_nsec;
+
+    ts->tv_sec += (time_t)(offset / 1000000000);
+    ts->tv_nsec = (long)(offset % 1000000000);
+
+    return 0;
+}
+
+int
+gettimeofday(struct timeval *restrict tv, void *restrict tz) {
+    struct test_vclock *vclock;
+    uint64_t offset;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    ret = test_real_gettimeofday(tv, tz);
+    if (ret == -1)
+        return ret;
+
+    vclock = test_vclock_self();
+    if (!vclock)
+        return ret;
+
+    offset = atomic_load(&vclock->offset) / 1000;
+    offset += (uint64_t)tv->tv_usec;
+
+    tv->tv_sec += (time_t)(offset / 1000000);
+    tv->tv_usec = (suseconds_t)(offset % 1000000);
+
+    return 0;
+}
+
+time_t
+time(time_t *ptime) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (ptime)
+        *ptime = ts.tv_sec;
+
+    return ts.tv_sec;
+}
+
+int
+clock_nanosleep(clockid_t clock, int flags, const struct timespec *req,
+                struct timespec *rem) {
+    struct test_vclock *vclock;
+    struct timespec now;
+    uint64_t deadline, duration;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_vclock_self();
+    if (!vclock || !test_vclock_is_virtual(clock))
+        return test_real_clock_nanosleep(clock, flags, req, rem);
+
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000)
+        return EINVAL;
+
+    deadline = (uint64_t)req->tv_sec * 1000000000 + (uint64_t)req->tv_nsec;
+
+    if (flags & TIMER_ABSTIME) {
+        uint64_t clock_now;
+
+        clock_gettime(clock, &now);
+        clock_now = (uint64_t)now.tv_sec * 1000000000
+                  + (uint64_t)now.tv_nsec;
+        if (deadline <= clock_now)
+            return 0;
+
+        duration = deadline - clock_now;
+    } else {
+        duration = deadline;
+    }
+
+    test_vclock_sleep_until(vclock, test_vclock_now(vclock) + duration,
+                            NULL, 0, NULL);
+
+    if (rem && !(flags & TIMER_ABSTIME)) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+
+    return 0;
+}
+
+int
+nanosleep(const struct timespec *req, struct timespec *rem) {
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    if (!test_vclock_self())
+        return test_real_nanosleep(req, rem);
+
+    ret = clock_nanosleep(CLOCK_MONOTONIC, 0, req, rem);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+usleep(useconds_t usec) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(usec / 1000000);
+    ts.tv_nsec = (long)(usec % 1000000) * 1000;
+
+    return nanosleep(&ts, NULL);
+}
+
+unsigned int
+sleep(unsigned int seconds) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = 0;
+
+    if (nanosleep(&ts, &ts) == -1)
+        return (unsigned int)ts.tv_sec;
+
+    return 0;
+}
+
+int
+poll(struct pollfd *fds, nfds_t nb_fds, int timeout) {
+    struct test_vclock *vclock;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    /* Without a timeout, the thread waits for events, not for time */
+    vclock = test_vclock_self();
+    if (timeout <= 0 || !vclock)
+        return test_real_poll(fds, nb_fds, timeout);
+
+    ret = test_real_poll(fds, nb_fds, 0);
+    if (ret != 0)
+        return ret;
+
+    test_vclock_sleep_until(vclock,
+                            test_vclock_now(vclock)
+                            + (uint64_t)timeout * 1000000,
+                            fds, nb_fds, &ret);
+    return ret;
+}
+
+int
+pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+               void *(*start)(void *), void *arg) {
+    struct test_vclock_thread *vthread;
+    struct test_vclock *vclock;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_vclock_self();
+    if (!vclock)
+        return test_real_pthread_create(thread, attr, start, arg);
+
+    vthread = test_malloc(sizeof(struct test_vclock_thread));
+    vthread->start = start;
+    vthread->arg = arg;
+    vthread->vclock = vclock;
+
+    atomic_fetch_add(&vclock->nb_refs, 1);
+
+    /* Count the thread now so that time does not jump before it starts */
+    pthread_mutex_lock(&vclock->mutex);
+    vclock->nb_threads++;
+    test_vclock_signal(vclock);
+    pthread_mutex_unlock(&vclock->mutex);
+
+    ret = test_real_pthread_create(thread, attr, test_vclock_thread_main,
+                                   vthread);
+    if (ret != 0) {
+        test_vclock_thread_exit(vthread);
+    }
+
+    return ret;
+}
+
+int
+pthread_join(pthread_t thread, void **result) {
+    struct test_vclock *vclock;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_vclock_self();
+    if (!vclock)
+        return test_real_pthread_join(thread, result);
+
+    test_vclock_block(vclock);
+    ret = test_real_pthread_join(thread, result);
+    test_vclock_unblock(vclock);
+
+    return ret;
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    struct test_vclock *vclock;
+    int ret;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_vclock_self();
+    if (!vclock)
+        return test_real_pthread_cond_wait(cond, mutex);
+
+    test_vclock_block(vclock);
+    ret = test_real_pthread_cond_wait(cond, mutex);
+    test_vclock_unblock(vclock);
+
+    return ret;
+}
+
+int
+pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                       const struct timespec *abs_time) {
+    struct test_vclock *vclock;
+    struct timespec real_abs_time;
+    uint64_t deadline, offset;
+
+    pthread_once(&test_vclock_once, test_vclock_init);
+
+    vclock = test_vclock_self();
+    if (!vclock || abs_time->tv_sec < 0 || abs_time->tv_nsec < 0
+     || abs_time->tv_nsec >= 1000000000) {
+        return test_real_pthread_cond_timedwait(cond, mutex, abs_time);
+    }
+
+    /* The wait is not virtual, the thread is running while it waits.
+     * Whatever the clock of the condition variable, its deadline was
+     * computed in virtual time and is brought back to real time. */
+    deadline = (uint64_t)abs_time->tv_sec * 1000000000
+             + (uint64_t)abs_time->tv_nsec;
+
+    offset = atomic_load(&vclock->offset);
+    deadline = (deadline > offset) ? deadline - offset : 0;
+
+    real_abs_time.tv_sec = (time_t)(deadline / 1000000000);
+    real_abs_time.tv_nsec = (long)(deadline % 1000000000);
+
+    return test_real_pthread_cond_timedwait(cond, mutex, &real_abs_time);
+}
+
+static void
+test_vclock_init(void) {
+    test_real_clock_gettime = test_vclock_symbol("clock_gettime");
+    test_real_gettimeofday = test_vclock_symbol("gettimeofday");
+    test_real_nanosleep = test_vclock_symbol("nanosleep");
+    test_real_clock_nanosleep = test_vclock_symbol("clock_nanosleep");
+    test_real_poll = test_vclock_symbol("poll");
+    test_real_pthread_create = test_vclock_symbol("pthread_create");
+    test_real_pthread_join = test_vclock_symbol("pthread_join");
+    test_real_pthread_cond_wait = test_vclock_symbol("pthread_cond_wait");
+    test_real_pthread_cond_timedwait =
+        test_vclock_symbol("pthread_cond_timedwait");
+}
+
+static void *
+test_vclock_symbol(const char *name) {
+    void *symbol;
+
+    symbol = dlsym(RTLD_NEXT, name);
+    if (!symbol) {
+        fprintf(stderr, "cannot find symbol %s: %s\n", name, dlerror());
+        abort();
+    }
+
+    return symbol;
+}
+
+static struct test_vclock *
+test_vclock_self(void) {
+    struct test_vclock *vclock;
+
+    vclock = test_vclock_current;
+    if (!vclock
+     || !atomic_load_explicit(&vclock->enabled, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return vclock;
+}
+
+static void
+test_vclock_release(struct test_vclock *vclock) {
+    if (atomic_fetch_sub(&vclock->nb_refs, 1) > 1)
+        return;
+
+    pthread_cond_destroy(&vclock->cond);
+    pthread_mutex_destroy(&vclock->mutex);
+    free(vclock);
+}
+
+static bool
+test_vclock_is_virtual(clockid_t clock) {
+    switch (clock) {
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_BOOTTIME:
+        return true;
+
+    default:
+        /* Cpu time is not affected */
+        return false;
+    }
+}
+
+static uint64_t
+test_vclock_real_now(void) {
+    struct timespec ts;
+
+    test_real_clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t
+test_vclock_now(struct test_vclock *vclock) {
+    return test_vclock_real_now() + atomic_load(&vclock->offset);
+}
+
+static void
+test_vclock_block(struct test_vclock *vclock) {
+    pthread_mutex_lock(&vclock->mutex);
+    vclock->nb_blocked++;
+    test_vclock_signal(vclock);
+    pthread_mutex_unlock(&vclock->mutex);
+}
+
+static void
+test_vclock_unblock(struct test_vclock *vclock) {
+    pthread_mutex_lock(&vclock->mutex);
+    vclock->nb_blocked--;
+    test_vclock_signal(vclock);
+    pthread_mutex_unlock(&vclock->mutex);
+}
+
+static void
+test_vclock_sleep_until(struct test_vclock *vclock, uint64_t deadline,
+                        struct pollfd *fds, nfds_t nb_fds, int *pret) {
+    struct test_vclock_sleeper sleeper, **psleeper;
+
+    pthread_mutex_lock(&vclock->mutex);
+
+    sleeper.deadline = deadline;
+    sleeper.next = vclock->sleepers;
+    vclock->sleepers = &sleeper;
+    vclock->nb_blocked++;
+    test_vclock_signal(vclock);
+
+    for (;;) {
+        struct timespec abs_time;
+        uint64_t now, generation, wait;
+        int ret;
+
+        if (!atomic_load(&vclock->enabled))
+            break;
+
+        now = test_vclock_now(vclock);
+        if (now >= deadline)
+            break;
+
+        if (fds) {
+            int nb_events;
+
+            /* Another thread of the test may have made a fd ready */
+            nb_events = test_real_poll(fds, nb_fds, 0);
+            if (nb_events != 0) {
+                *pret = nb_events;
+                break;
+            }
+        }
+
+        /* Wait until the deadline in real time, or until the grace period
+         * expires if every thread of the test is blocked */
+        wait = deadline - now;
+        if (vclock->nb_blocked >= vclock->nb_threads
+         && wait > TEST_VCLOCK_GRACE) {
+            wait = TEST_VCLOCK_GRACE;
+        }
+
+        generation = vclock->generation;
+
+        now = test_vclock_real_now() + wait;
+        abs_time.tv_sec = (time_t)(now / 1000000000);
+        abs_time.tv_nsec = (long)(now % 1000000000);
+
+        ret = test_real_pthread_cond_timedwait(&vclock->cond,
+                                               &vclock->mutex, &abs_time);
+
+        if (ret == ETIMEDOUT
+         && atomic_load(&vclock->enabled)
+         && vclock->generation == generation
+         && vclock->nb_blocked >= vclock->nb_threads) {
+            struct test_vclock_sleeper *s;
+            uint64_t earliest;
+
+            /* Nothing happened: jump to the earliest deadline */
+            earliest = deadline;
+            for (s = vclock->sleepers; s; s = s->next) {
+                if (s->deadline < earliest)
+                    earliest = s->deadline;
+            }
+
+            now = test_vclock_now(vclock);
+            if (earliest > now)
+                atomic_fetch_add(&vclock->offset, earliest - now);
+
+            test_vclock_signal(vclock);
+        }
+    }
+
+    for (psleeper = &vclock->sleepers; *psleeper;
+         psleeper = &(*psleeper)->next) {
+        if (*psleeper == &sleeper) {
+            *psleeper = sleeper.next;
+            break;
+        }
+    }
+
+    vclock->nb_blocked--;
+    test_vclock_signal(vclock);
+
+    pthread_mutex_unlock(&vclock->mutex);
+}
+
+static void
+test_vclock_signal(struct test_vclock *vclock) {
+    vclock->generation++;
+    pthread_cond_broadcast(&vclock->cond);
+}
+
+static void *
+test_vclock_thread_main(void *arg) {
+    struct test_vclock_thread *vthread;
+    void *(*start)(void *);
+    void *start_arg, *result;
+
+    vthread = arg;
+    start = vthread->start;
+    start_arg = vthread->arg;
+
+    test_vclock_current = vthread->vclock;
+
+    pthread_cleanup_push(test_vclock_thread_exit, vthread);
+    result = start(start_arg);
+    pthread_cleanup_pop(1);
+
+    return result;
+}
+
+static void
+test_vclock_thread_exit(void *arg) {
+    struct test_vclock_thread *vthread;
+    struct test_vclock *vclock;
+
+    vthread = arg;
+    vclock = vthread->vclock;
+
+    /* Also runs on pthread_exit() and cancellation */
+    free(vthread);
+
+    pthread_mutex_lock(&vclock->mutex);
+    vclock->nb_threads--;
+    test_vclock_signal(vclock);
+    pthread_mutex_unlock(&vclock->mutex);
+
+    test_vclock_current = NULL;
+    test_vclock_release(vclock);
+}
@@ -14,10 +14,24 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/times.h>
+
+#include <pthread.h>
+#include <unistd.h>
 
 #include "../src/utest.h"
 
+/* Defined after main() */
+TEST_DECLARE(declared);
+
 TEST(true_false) {
     TEST_TRUE(true);
     TEST_FALSE(false);
@@ -48,6 +62,44 @@ TEST(real_failure) {
 }
 
 
+TEST(real_arrays) {
+    float floats[] = {1.0f, 2.0f, 3.0000002f};
+    float expected_floats[] = {1.0f, 2.0f, 3.0f};
+    double doubles[] = {1.0, 2.000001, -3.0};
+    double expected_doubles[] = {1.0, 2.0, -3.0};
+
+    TEST_FLOAT_ARRAY_NEAR(floats, expected_floats, 3, TEST_TOLERANCE_ULP, 1);
+    TEST_DOUBLE_ARRAY_NEAR(doubles, expected_doubles, 3,
+                           TEST_TOLERANCE_ABSOLUTE, 1e-5);
+    TEST_DOUBLE_ARRAY_NEAR(doubles, expected_doubles, 3,
+                           TEST_TOLERANCE_RELATIVE, 1e-6);
+}
+
+TEST(real_rounding_failure) {
+    float floats[] = {0.1f, 1.0f};
+    float expected_floats[] = {0.0f, 0.0f};
+
+    /* 0.1f is above 0.1, but within the tolerance rounded to a float: only
+     * the second element is out of tolerance */
+    TEST_FLOAT_ARRAY_NEAR(floats, expected_floats, 2,
+                          TEST_TOLERANCE_ABSOLUTE, 0.1);
+}
+
+TEST(real_tolerance_failure) {
+    double doubles[] = {1.0};
+
+    TEST_DOUBLE_ARRAY_NEAR(doubles, doubles, 1, TEST_TOLERANCE_ULP, -1.0);
+}
+
+TEST(real_array_failure) {
+    double doubles[] = {1.0, 2.5, 3.0, -4.0};
+    double expected_doubles[] = {1.0, 2.0, 3.0000001, 4.0};
+
+    TEST_DOUBLE_ARRAY_NEAR(doubles, expected_doubles, 4,
+                           TEST_TOLERANCE_ULP, 4);
+}
+
+
 TEST(booleans) {
     TEST_BOOL_EQ(true, true);
     TEST_BOOL_EQ(false, false);
@@ -74,6 +126,11 @@ TEST(string_failure_3) {
     TEST_STRING_EQ(NULL, "foo");
 }
 
+TEST(string_failure_4) {
+    TEST_STRING_EQ("one\ntwo\nthree\nfour\nfive\nsix\nseven\neight\nnine",
+                   "one\ntwo\n3\nfour\nfive\nsix\nseven\neight\nnine\nten\n");
+}
+
 
 TEST(memory) {
     TEST_MEM_EQ("foobar", 3, "foo", 3);
@@ -96,6 +153,286 @@ TEST(memory_failure_4) {
 }
 
 
+TEST(typed) {
+    uint8_t u8 = 200;
+    size_t sz = 42;
+    const char *str = "foo";
+
+    TEST_EQ(u8, 200);
+    TEST_EQ(sz, 42);
+    TEST_EQ(-3, -3);
+    TEST_EQ(1.5f, 1.5f);
+    TEST_EQ(str, "foo");
+    TEST_EQ((void *)printf, (void *)printf);
+
+    /* Values are compared with the types of both sides */
+    TEST_EQ(sz, 42.0);
+    TEST_EQ(-1, -1LL);
+    TEST_EQ(u8, 200u);
+    TEST_EQ(1 == 1, true);
+}
+
+TEST(typed_failure_1) {
+    uint8_t u8 = 200;
+
+    TEST_EQ(u8, 100);
+}
+
+TEST(typed_failure_2) {
+    TEST_EQ("foo", "bar");
+}
+
+TEST(typed_failure_truncation) {
+    uint8_t u8 = 200;
+
+    TEST_EQ(u8, 456);
+}
+
+TEST(typed_failure_float) {
+    int i = 2;
+
+    TEST_EQ(i, 2.5);
+}
+
+TEST(typed_failure_sign) {
+    int i = -1;
+
+    TEST_EQ(i, UINT_MAX);
+}
+
+
+/* Golden file paths are relative to the root of the repository, which
+ * tests/main must be run from */
+TEST(golden_files) {
+    const char *text = "hello\nworld\n";
+
+    TEST_FILE_EQ(text, strlen(text), "tests/golden/hello.txt");
+}
+
+TEST(golden_file_failure) {
+    const char *text = "hello\nwordl\n";
+
+    TEST_FILE_EQ(text, strlen(text), "tests/golden/hello_failure.txt");
+}
+
+TEST(signal_failure_1) {
+    volatile int *ptr = NULL;
+
+    *ptr = 42;
+}
+
+TEST(signal_failure_2) {
+    abort();
+}
+
+TEST(output) {
+    printf("this line is only shown if the test fails\n");
+}
+
+TEST(output_failure) {
+    printf("written to stdout\n");
+    fprintf(stderr, "written to stderr\n");
+
+    TEST_TRUE(false);
+}
+
+TEST(output_child) {
+    pid_t pid;
+
+    /* The child keeps the output of the test open after the test is over */
+    pid = fork();
+    TEST_TRUE(pid != -1);
+
+    if (pid == 0) {
+        sleep(1);
+        _exit(0);
+    }
+
+    printf("written by the parent\n");
+}
+
+enum {
+    COUNTER_INCREMENT,
+};
+
+struct counter_thread {
+    struct test_history_recorder *recorder;
+    atomic_long *counter;
+};
+
+static bool
+counter_model_step(void *state, const struct test_history_op *op) {
+    long *value = state;
+
+    if (op->response_time > 0 && op->result != *value)
+        return false;
+
+    (*value)++;
+    return true;
+}
+
+static const struct test_model counter_model = {
+    .state_size = sizeof(long),
+    .step = counter_model_step,
+};
+
+static void *
+counter_thread_main(void *arg) {
+    struct counter_thread *thread = arg;
+
+    for (int i = 0; i < 100; i++) {
+        size_t op;
+        long value;
+
+        op = test_history_invoke(thread->recorder, COUNTER_INCREMENT, 0);
+        value = atomic_fetch_add(thread->counter, 1);
+        test_history_respond(thread->recorder, op, value);
+    }
+
+    return NULL;
+}
+
+TEST(linearizability) {
+    struct test_history *history;
+    struct counter_thread threads[4];
+    pthread_t thread_ids[4];
+    atomic_long counter;
+
+    atomic_init(&counter, 0);
+    history = test_history_new(4, 100);
+
+    for (size_t i = 0; i < 4; i++) {
+        threads[i].recorder = test_history_recorder(history, i);
+        threads[i].counter = &counter;
+        pthread_create(&thread_ids[i], NULL, counter_thread_main,
+                       threads + i);
+    }
+
+    for (size_t i = 0; i < 4; i++)
+        pthread_join(thread_ids[i], NULL);
+
+    TEST_LINEARIZABLE(history, &counter_model);
+    test_history_delete(history);
+}
+
+TEST(linearizability_pending) {
+    struct test_history *history;
+    struct test_history_recorder *a, *b;
+    size_t op_a, op_b;
+
+    history = test_history_new(2, 10);
+    a = test_history_recorder(history, 0);
+    b = test_history_recorder(history, 1);
+
+    /* A is invoked first but takes effect after B */
+    op_a = test_history_invoke(a, COUNTER_INCREMENT, 0);
+    op_b = test_history_invoke(b, COUNTER_INCREMENT, 0);
+    test_history_respond(b, op_b, 0);
+    test_history_respond(a, op_a, 1);
+
+    /* A never returns, but B sees its effect */
+    test_history_invoke(a, COUNTER_INCREMENT, 0);
+    op_b = test_history_invoke(b, COUNTER_INCREMENT, 0);
+    test_history_respond(b, op_b, 3);
+
+    TEST_LINEARIZABLE(history, &counter_model);
+    test_history_delete(history);
+}
+
+TEST(linearizability_failure) {
+    struct test_history *history;
+    struct test_history_recorder *recorder;
+    long counter;
+
+    /* The counter is never incremented */
+    history = test_history_new(1, 10);
+    recorder = test_history_recorder(history, 0);
+    counter = 0;
+
+    for (int i = 0; i < 3; i++) {
+        size_t op;
+
+        op = test_history_invoke(recorder, COUNTER_INCREMENT, 0);
+        test_history_respond(recorder, op, counter);
+    }
+
+    TEST_LINEARIZABLE(history, &counter_model);
+}
+
+TEST(async_sleep) {
+    TEST_SLEEP(50);
+}
+
+TEST(async_pipe) {
+    int fds[2];
+
+    TEST_INT_EQ(pipe(fds), 0);
+    TEST_INT_EQ(write(fds[1], "x", 1), 1);
+    TEST_UINT_EQ(TEST_WAIT_READABLE(fds[0], 1000), TEST_READABLE);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static int async_shared_fds[2];
+
+TEST(async_shared_pipe) {
+    TEST_UINT_EQ(TEST_WAIT_READABLE(async_shared_fds[0], 1000),
+                 TEST_READABLE);
+}
+
+TEST(async_timeout_failure) {
+    uint32_t events;
+    int fds[2];
+
+    TEST_INT_EQ(pipe(fds), 0);
+    events = TEST_WAIT_READABLE(fds[0], 20);
+
+    /* The check fails and leaves the test */
+    close(fds[0]);
+    close(fds[1]);
+
+    TEST_UINT_EQ(events, TEST_READABLE);
+}
+
+static void *
+virtual_time_worker(void *arg) {
+    struct timespec duration = {.tv_sec = 10};
+
+    nanosleep(&duration, NULL);
+
+    /* Leaving with pthread_exit() must also release the thread */
+    pthread_exit(arg);
+}
+
+TEST(virtual_time) {
+    struct timespec before, after;
+    struct tms tms;
+    clock_t real_before, real_after;
+    time_t time_before;
+    pthread_t thread;
+
+    TEST_VIRTUAL_TIME();
+
+    /* times() is not virtual and measures real time */
+    real_before = times(&tms);
+
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    time_before = time(NULL);
+
+    TEST_UINT_EQ(sleep(60), 0);
+
+    TEST_INT_EQ(pthread_create(&thread, NULL, virtual_time_worker, NULL), 0);
+    TEST_INT_EQ(pthread_join(thread, NULL), 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    TEST_TRUE(after.tv_sec - before.tv_sec >= 70);
+    TEST_TRUE(time(NULL) - time_before >= 70);
+
+    real_after = times(&tms);
+    TEST_TRUE(real_after - real_before < sysconf(_SC_CLK_TCK));
+}
+
 TEST(pointers) {
     TEST_PTR_EQ(printf, printf);
     TEST_PTR_NULL(NULL);
@@ -122,11 +459,261 @@ TEST(pointer_failure_5) {
     TEST_PTR_NOT_NULL(NULL);
 }
 
+TEST(registered_1) {
+    TEST_INT_EQ(1, 1);
+}
+
+TEST(registered_2) {
+    TEST_STRING_EQ("registered", "registered");
+}
+
+TEST(registered_failure) {
+    TEST_INT_EQ(1, 2);
+}
+
+TEST(setjmp_body) {
+    jmp_buf env;
+    volatile int nb_jumps;
+
+    nb_jumps = 0;
+    if (setjmp(env) == 0) {
+        nb_jumps++;
+        longjmp(env, 1);
+    }
+
+    TEST_INT_EQ(nb_jumps, 1);
+}
+
+TEST(profiled) {
+    struct timespec start, now;
+
+    /* Samples are taken every millisecond of cpu time */
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    do {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000
+             + (now.tv_nsec - start.tv_nsec) / 1000000 < 50);
+}
+
+TEST(profile) {
+    struct test_suite *profiled_suite;
+    struct test_reporter reporter;
+    char line[1024];
+    FILE *file;
+    bool found;
+
+    file = tmpfile();
+    TEST_PTR_NOT_NULL(file);
+
+    memset(&reporter, 0, sizeof(struct test_reporter));
+
+    profiled_suite = test_suite_new("profiled");
+    test_suite_add_reporter(profiled_suite, &reporter);
+    test_suite_set_profile_output(profiled_suite, file);
+    test_suite_start(profiled_suite);
+
+    TEST_RUN(profiled_suite, profiled);
+
+    test_suite_delete(profiled_suite);
+
+    /* Folded stacks start with the name of the test */
+    rewind(file);
+    found = false;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "profiled", 8) == 0
+         && (line[8] == ';' || line[8] == ' ')) {
+            found = true;
+        }
+    }
+    fclose(file);
+
+    TEST_TRUE(found);
+}
+
+static struct test_bin *
+bin_open_data(const char *data, size_t size) {
+    char path[] = "/tmp/utest-bin-XXXXXX";
+    struct test_bin *bin;
+    bool written;
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd == -1)
+        return NULL;
+
+    written = write(fd, data, size) == (ssize_t)size;
+    close(fd);
+
+    /* The file stays mapped once removed */
+    bin = written ? test_bin_open(path) : NULL;
+    unlink(path);
+
+    return bin;
+}
+
+TEST(bin_round_trip) {
+    struct test_reporter reporter;
+    struct test_record records[3];
+    struct test_results results;
+    const struct test_bin_record *record;
+    struct test_bin *bin, *truncated, *corrupted;
+    int truncated_errno, corrupted_errno;
+    uint32_t bad_offset;
+    char data[4096];
+    size_t size;
+    FILE *file;
+
+    file = tmpfile();
+    TEST_PTR_NOT_NULL(file);
+
+    memset(records, 0, sizeof(records));
+
+    records[0].test_name = "second";
+    records[0].status = TEST_STATUS_PASSED;
+    records[0].duration = 1000;
+
+    records[1].test_name = "first";
+    records[1].status = TEST_STATUS_FAILED;
+    records[1].file = "main.c";
+    records[1].line = 42;
+    records[1].message = "broken";
+
+    records[2].test_name = "third";
+    records[2].status = TEST_STATUS_PASSED;
+
+    memset(&results, 0, sizeof(struct test_results));
+    results.nb_tests = 3;
+    results.nb_passed_tests = 2;
+    results.nb_failed_tests = 1;
+
+    reporter = test_reporter_bin(file);
+    reporter.begin_suite(reporter.data, "bin");
+    reporter.end_test(reporter.data, records, 3);
+    reporter.end_suite(reporter.data, &results);
+    reporter.free_data(reporter.data);
+
+    rewind(file);
+    size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    TEST_TRUE(size > 8 && size < sizeof(data));
+
+    bin = bin_open_data(data, size);
+
+    truncated = bin_open_data(data, size - 8);
+    truncated_errno = errno;
+
+    /* Records follow the 16 byte header and start with the offset of the
+     * test name */
+    bad_offset = UINT32_MAX;
+    memcpy(data + 16, &bad_offset, sizeof(uint32_t));
+    corrupted = bin_open_data(data, size);
+    corrupted_errno = errno;
+
+    TEST_PTR_NULL(truncated);
+    TEST_INT_EQ(truncated_errno, EINVAL);
+    TEST_PTR_NULL(corrupted);
+    TEST_INT_EQ(corrupted_errno, EINVAL);
+
+    TEST_PTR_NOT_NULL(bin);
+    TEST_STRING_EQ(test_bin_suite_name(bin), "bin");
+
+    test_bin_results(bin, &results);
+    TEST_UINT_EQ(results.nb_tests, 3);
+    TEST_UINT_EQ(results.nb_passed_tests, 2);
+    TEST_UINT_EQ(results.nb_failed_tests, 1);
+
+    TEST_UINT_EQ(test_bin_nb_records(bin), 3);
+
+    record = test_bin_record(bin, 0);
+    TEST_STRING_EQ(test_bin_string(bin, record->test_name), "second");
+    TEST_UINT_EQ(record->status, TEST_STATUS_PASSED);
+    TEST_UINT_EQ(record->duration, 1000);
+    TEST_STRING_EQ(test_bin_string(bin, record->message), "");
+
+    record = test_bin_find(bin, "first");
+    TEST_PTR_NOT_NULL(record);
+    TEST_UINT_EQ(record->status, TEST_STATUS_FAILED);
+    TEST_STRING_EQ(test_bin_string(bin, record->file), "main.c");
+    TEST_INT_EQ(record->line, 42);
+    TEST_STRING_EQ(test_bin_string(bin, record->message), "broken");
+
+    record = test_bin_sorted_record(bin, 2);
+    TEST_STRING_EQ(test_bin_string(bin, record->test_name), "third");
+    TEST_PTR_NULL(test_bin_find(bin, "fourth"));
+
+    test_bin_close(bin);
+}
+
+TEST(progress_fallback) {
+    struct test_reporter reporter;
+    struct test_record record;
+    char line[128];
+    FILE *file;
+    bool read;
+
+    file = tmpfile();
+    TEST_PTR_NOT_NULL(file);
+
+    /* Files are not terminals and get one line per test */
+    reporter = test_reporter_progress(file, 100);
+
+    memset(&record, 0, sizeof(struct test_record));
+    record.test_name = "fallback";
+    record.status = TEST_STATUS_PASSED;
+    reporter.end_test(reporter.data, &record, 1);
+
+    rewind(file);
+    read = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+
+    TEST_TRUE(read);
+    TEST_STRING_EQ(line, "\e[32m.\e[0m fallback                  "
+                   "\e[32mok\e[0m\n");
+}
+
+static void
+planned_tests(void *data, size_t nb_tests) {
+    size_t *pnb_tests;
+
+    pnb_tests = data;
+    *pnb_tests = nb_tests;
+}
+
+TEST(planned) {
+}
+
+TEST(plan_tests) {
+    struct test_suite *planned_suite;
+    struct test_reporter reporter;
+    size_t nb_tests;
+
+    nb_tests = 0;
+
+    memset(&reporter, 0, sizeof(struct test_reporter));
+    reporter.plan_tests = planned_tests;
+    reporter.data = &nb_tests;
+
+    planned_suite = test_suite_new("planned");
+    test_suite_add_reporter(planned_suite, &reporter);
+    test_suite_start(planned_suite);
+
+    TEST_ADD(planned_suite, planned);
+    TEST_ADD(planned_suite, planned);
+    test_suite_run(planned_suite);
+
+    test_suite_delete(planned_suite);
+
+    TEST_UINT_EQ(nb_tests, 2);
+}
+
 int
 main(int argc, char **argv) {
     struct test_suite *suite;
 
     suite = test_suite_new("main");
+    test_suite_set_catch_signals(suite, true);
+    test_suite_set_capture_output(suite, true);
     test_suite_initialize_from_args(suite, argc, argv);
 
     test_suite_start(suite);
@@ -139,6 +726,10 @@ main(int argc, char **argv) {
 
     TEST_RUN(suite, reals);
     TEST_RUN(suite, real_failure);
+    TEST_RUN(suite, real_arrays);
+    TEST_RUN(suite, real_array_failure);
+    TEST_RUN(suite, real_rounding_failure);
+    TEST_RUN(suite, real_tolerance_failure);
 
     TEST_RUN(suite, booleans);
     TEST_RUN(suite, boolean_failure);
@@ -147,6 +738,7 @@ main(int argc, char **argv) {
     TEST_RUN(suite, string_failure_1);
     TEST_RUN(suite, string_failure_2);
     TEST_RUN(suite, string_failure_3);
+    TEST_RUN(suite, string_failure_4);
 
     TEST_RUN(suite, memory);
     TEST_RUN(suite, memory_failure_1);
@@ -154,6 +746,57 @@ main(int argc, char **argv) {
     TEST_RUN(suite, memory_failure_3);
     TEST_RUN(suite, memory_failure_4);
 
+    TEST_RUN(suite, typed);
+    TEST_RUN(suite, typed_failure_1);
+    TEST_RUN(suite, typed_failure_2);
+    TEST_RUN(suite, typed_failure_truncation);
+    TEST_RUN(suite, typed_failure_float);
+    TEST_RUN(suite, typed_failure_sign);
+
+    TEST_RUN(suite, golden_files);
+    TEST_RUN(suite, golden_file_failure);
+
+    TEST_RUN(suite, signal_failure_1);
+    TEST_RUN(suite, signal_failure_2);
+
+    TEST_RUN(suite, output);
+    TEST_RUN(suite, output_failure);
+    TEST_RUN(suite, output_child);
+
+    TEST_RUN(suite, linearizability);
+    TEST_RUN(suite, linearizability_pending);
+    TEST_RUN(suite, linearizability_failure);
+
+    TEST_RUN(suite, virtual_time);
+
+    TEST_RUN(suite, setjmp_body);
+    TEST_RUN(suite, declared);
+
+    TEST_RUN(suite, profile);
+    TEST_RUN(suite, bin_round_trip);
+    TEST_RUN(suite, progress_fallback);
+    TEST_RUN(suite, plan_tests);
+
+    /* The five sleeps run concurrently */
+    for (int i = 0; i < 5; i++)
+        TEST_ADD_ASYNC(suite, async_sleep);
+    TEST_ADD_ASYNC(suite, async_pipe);
+    TEST_ADD_ASYNC(suite, async_timeout_failure);
+
+    /* Two tests waiting for the same descriptor */
+    if (pipe(async_shared_fds) == -1
+     || write(async_shared_fds[1], "x", 1) != 1) {
+        perror("cannot create pipe");
+        exit(1);
+    }
+    TEST_ADD_ASYNC(suite, async_shared_pipe);
+    TEST_ADD_ASYNC(suite, async_shared_pipe);
+
+    test_suite_run_async(suite);
+
+    close(async_shared_fds[0]);
+    close(async_shared_fds[1]);
+
     TEST_RUN(suite, pointers);
     TEST_RUN(suite, pointer_failure_1);
     TEST_RUN(suite, pointer_failure_2);
@@ -161,5 +804,15 @@ main(int argc, char **argv) {
     TEST_RUN(suite, pointer_failure_4);
     TEST_RUN(suite, pointer_failure_5);
 
+    /* Registered tests run together, in a random order with --shuffle */
+    TEST_ADD(suite, registered_1);
+    TEST_ADD(suite, registered_2);
+    TEST_ADD(suite, registered_failure);
+    test_suite_run(suite);
+
     test_suite_print_results_and_exit(suite);
 }
+
+TEST(declared) {
+    TEST_TRUE(true);
+}
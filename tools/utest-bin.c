@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "../src/utest.h"
+
+struct bin_stats_entry {
+    const char *test_name;
+    const struct test_bin_record *record;
+};
+
+static void bin_dump(int, char **);
+static void bin_diff(int, char **);
+static void bin_stats(int, char **);
+
+static struct test_bin *bin_open(const char *);
+static const char *bin_status_string(uint32_t);
+static int bin_stats_entry_cmp(const void *, const void *);
+
+static void bin_usage(const char *, int)
+    __attribute__ ((noreturn));
+static void bin_die(const char *, ...)
+    __attribute__ ((format(printf, 1, 2), noreturn));
+
+int
+main(int argc, char **argv) {
+    const char *command;
+    int opt;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "h")) != -1) {
+        switch (opt) {
+        case 'h':
+            bin_usage(argv[0], 0);
+            break;
+
+        case '?':
+            bin_usage(argv[0], 1);
+        }
+    }
+
+    if (optind >= argc)
+        bin_usage(argv[0], 1);
+
+    command = argv[optind];
+    argc -= optind + 1;
+    argv += optind + 1;
+
+    if (strcmp(command, "dump") == 0) {
+        bin_dump(argc, argv);
+    } else if (strcmp(command, "diff") == 0) {
+        bin_diff(argc, argv);
+    } else if (strcmp(command, "stats") == 0) {
+        bin_stats(argc, argv);
+    } else {
+        bin_die("unknown command '%s'", command);
+    }
+
+    return 0;
+}
+
+static void
+bin_dump(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        struct test_results results;
+        struct test_bin *bin;
+
+        bin = bin_open(argv[i]);
+        test_bin_results(bin, &results);
+
+        printf("%s: suite %s, %zu tests, %zu passed, %zu failed, %.3f ms\n",
+               argv[i], test_bin_suite_name(bin), results.nb_tests,
+               results.nb_passed_tests, results.nb_failed_tests,
+               (double)results.duration / 1e6);
+
+        for (size_t j = 0; j < test_bin_nb_records(bin); j++) {
+            const struct test_bin_record *record;
+
+            record = test_bin_record(bin, j);
+
+            printf("  %-6s  %-24s  %12.3f us",
+                   bin_status_string(record->status),
+                   test_bin_string(bin, record->test_name),
+                   (double)record->duration / 1e3);
+
+            if (record->status != TEST_STATUS_PASSED) {
+                printf("  %s:%d  %s",
+                       test_bin_string(bin, record->file), record->line,
+                       test_bin_string(bin, record->message));
+            }
+
+            putchar('\n');
+        }
+
+        test_bin_close(bin);
+    }
+}
+
+static void
+bin_diff(int argc, char **argv) {
+    struct test_bin *old_bin, *new_bin;
+    size_t i, j, nb_old, nb_new;
+
+    if (argc != 2)
+        bin_die("usage: diff <old-file> <new-file>");
+
+    old_bin = bin_open(argv[0]);
+    new_bin = bin_open(argv[1]);
+
+    nb_old = test_bin_nb_records(old_bin);
+    nb_new = test_bin_nb_records(new_bin);
+
+    /* Both name indexes are sorted, walk them together */
+    i = 0;
+    j = 0;
+
+    while (i < nb_old || j < nb_new) {
+        const struct test_bin_record *old_record, *new_record;
+        const char *old_name, *new_name;
+        int cmp;
+
+        old_record = (i < nb_old) ? test_bin_sorted_record(old_bin, i) : NULL;
+        new_record = (j < nb_new) ? test_bin_sorted_record(new_bin, j) : NULL;
+
+        old_name = old_record
+            ? test_bin_string(old_bin, old_record->test_name) : NULL;
+        new_name = new_record
+            ? test_bin_string(new_bin, new_record->test_name) : NULL;
+
+        if (!old_name) {
+            cmp = 1;
+        } else if (!new_name) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(old_name, new_name);
+        }
+
+        if (cmp < 0) {
+            printf("- %-24s  %s\n",
+                   old_name, bin_status_string(old_record->status));
+            i++;
+        } else if (cmp > 0) {
+            printf("+ %-24s  %s\n",
+                   new_name, bin_status_string(new_record->status));
+            j++;
+        } else {
+            double old_duration, new_duration;
+
+            old_duration = (double)old_record->duration;
+            new_duration = (double)new_record->duration;
+
+            if (old_record->status != new_record->status) {
+                printf("~ %-24s  %s -> %s",
+                       new_name, bin_status_string(old_record->status),
+                       bin_status_string(new_record->status));
+
+                if (new_record->status != TEST_STATUS_PASSED) {
+                    printf("  %s", test_bin_string(new_bin,
+                                                   new_record->message));
+                }
+
+                putchar('\n');
+            } else if (old_duration > 0.0
+                    && (new_duration > old_duration * 1.5
+                     || new_duration < old_duration / 1.5)) {
+                printf("~ %-24s  %.3f us -> %.3f us (%+.0f%%)\n",
+                       new_name, old_duration / 1e3, new_duration / 1e3,
+                       (new_duration / old_duration - 1.0) * 100.0);
+            }
+
+            i++;
+            j++;
+        }
+    }
+
+    test_bin_close(old_bin);
+    test_bin_close(new_bin);
+}
+
+static void
+bin_stats(int argc, char **argv) {
+    struct test_bin **bins;
+    struct bin_stats_entry *entries;
+    size_t nb_entries, entries_sz;
+
+    bins = calloc((size_t)argc + 1, sizeof(struct test_bin *));
+    if (!bins)
+        bin_die("cannot allocate memory: %s", strerror(errno));
+
+    entries = NULL;
+    nb_entries = 0;
+    entries_sz = 0;
+
+    /* Files stay mapped so that entries can point into them */
+    for (int i = 0; i < argc; i++) {
+        size_t nb_records;
+
+        bins[i] = bin_open(argv[i]);
+        nb_records = test_bin_nb_records(bins[i]);
+
+        if (nb_entries + nb_records > entries_sz) {
+            entries_sz = (entries_sz + nb_records) * 2;
+            entries = realloc(entries,
+                              entries_sz * sizeof(struct bin_stats_entry));
+            if (!entries)
+                bin_die("cannot allocate memory: %s", strerror(errno));
+        }
+
+        for (size_t j = 0; j < nb_records; j++) {
+            const struct test_bin_record *record;
+
+            record = test_bin_record(bins[i], j);
+
+            entries[nb_entries].test_name =
+                test_bin_string(bins[i], record->test_name);
+            entries[nb_entries].record = record;
+            nb_entries++;
+        }
+    }
+
+    qsort(entries, nb_entries, sizeof(struct bin_stats_entry),
+          bin_stats_entry_cmp);
+
+    printf("%-24s  %8s  %8s  %12s  %12s  %12s\n",
+           "test", "runs", "failures", "min (us)", "mean (us)", "max (us)");
+
+    for (size_t i = 0; i < nb_entries;) {
+        uint64_t min, max, sum;
+        size_t nb_runs, nb_failures;
+        const char *test_name;
+
+        test_name = entries[i].test_name;
+
+        min = UINT64_MAX;
+        max = 0;
+        sum = 0;
+        nb_runs = 0;
+        nb_failures = 0;
+
+        for (; i < nb_entries; i++) {
+            const struct test_bin_record *record;
+
+            if (strcmp(entries[i].test_name, test_name) != 0)
+                break;
+
+            record = entries[i].record;
+
+            if (record->duration < min)
+                min = record->duration;
+            if (record->duration > max)
+                max = record->duration;
+            sum += record->duration;
+
+            nb_runs++;
+            if (record->status != TEST_STATUS_PASSED)
+                nb_failures++;
+        }
+
+        printf("%-24s  %8zu  %8zu  %12.3f  %12.3f  %12.3f\n",
+               test_name, nb_runs, nb_failures, (double)min / 1e3,
+               (double)sum / (double)nb_runs / 1e3, (double)max / 1e3);
+    }
+
+    free(entries);
+
+    for (int i = 0; i < argc; i++)
+        test_bin_close(bins[i]);
+    free(bins);
+}
+
+static struct test_bin *
+bin_open(const char *path) {
+    struct test_bin *bin;
+
+    bin = test_bin_open(path);
+    if (!bin)
+        bin_die("cannot open %s: %s", path, strerror(errno));
+
+    return bin;
+}
+
+static const char *
+bin_status_string(uint32_t status) {
+    switch (status) {
+    case TEST_STATUS_PASSED:
+        return "passed";
+    case TEST_STATUS_FAILED:
+        return "failed";
+    }
+
+    return "unknown";
+}
+
+static int
+bin_stats_entry_cmp(const void *p1, const void *p2) {
+    const struct bin_stats_entry *e1, *e2;
+
+    e1 = p1;
+    e2 = p2;
+
+    return strcmp(e1->test_name, e2->test_name);
+}
+
+static void
+bin_usage(const char *argv0, int exit_code) {
+    printf("Usage: %s [-h] <command> <file>...\n"
+            "\n"
+            "Options:\n"
+            "  -h            display help\n"
+            "\n"
+            "Commands:\n"
+            "  dump <file>...          print the content of result files\n"
+            "  diff <old> <new>        compare the results of two runs\n"
+            "  stats <file>...         aggregate results per test\n",
+            argv0);
+    exit(exit_code);
+}
+
+static void
+bin_die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}